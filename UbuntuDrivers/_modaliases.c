@@ -0,0 +1,388 @@
+/* _modaliases:
+ *
+ * Find the modaliases of the devices in sysfs, for
+ * UbuntuDrivers.detect.system_modaliases().
+ *
+ * Rather than walking all of /sys/devices, only the devices listed in
+ * /sys/bus/<bus>/devices and /sys/class/<class> are looked at, with one
+ * getdents64() call per directory and without following the rest of the
+ * device tree.
+ *
+ * Copyright (C) 2014 Canonical Ltd
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+#define PY_SSIZE_T_CLEAN
+
+#include <Python.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct scan {
+    /* The sysfs root, and its devices directory */
+    char devices[PATH_MAX];
+    size_t devices_len;
+    /* modalias -> path */
+    PyObject *aliases;
+    /* The paths already looked at, as devices can be in a bus and a class */
+    PyObject *seen;
+    int found;
+    /* Whether the subsystems being looked at are buses */
+    bool bus;
+};
+
+typedef int (*entry_func)(struct scan *scan, int dir_fd, const char *dir_path,
+                          const char *name);
+
+
+/* Call func for each entry of a directory but "." and "..". Return 0, or
+ * a negative errno
+ */
+static int for_each_entry(struct scan *scan, int dir_fd, const char *dir_path,
+                          entry_func func)
+{
+    char buffer[32768] __attribute__((aligned(8)));
+    long len;
+
+    while ((len = syscall(SYS_getdents64, dir_fd, buffer, sizeof(buffer))) > 0) {
+        for (long pos = 0; pos < len;) {
+            struct linux_dirent64 *entry = (struct linux_dirent64 *)(buffer + pos);
+            int status;
+
+            pos += entry->d_reclen;
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                continue;
+
+            status = func(scan, dir_fd, dir_path, entry->d_name);
+            if (status < 0)
+                return status;
+        }
+    }
+
+    return len < 0 ? -errno : 0;
+}
+
+
+/* Resolve "." and ".." in an absolute path, without looking at the file
+ * system, as os.walk() doesn't follow the symlinks in the path either
+ */
+static void normalize_path(char *path)
+{
+    char *out = path;
+    const char *in = path;
+
+    while (*in) {
+        const char *end;
+        size_t len;
+
+        while (*in == '/')
+            in++;
+        end = strchrnul(in, '/');
+        len = end - in;
+
+        if (len == 0 || (len == 1 && in[0] == '.')) {
+            /* Nothing to add */
+        }
+        else if (len == 2 && in[0] == '.' && in[1] == '.') {
+            while (out > path && *--out != '/')
+                ;
+        }
+        else {
+            *out++ = '/';
+            memmove(out, in, len);
+            out += len;
+        }
+        in = end;
+    }
+
+    if (out == path)
+        *out++ = '/';
+    *out = '\0';
+}
+
+
+/* Read a small sysfs attribute. Return its length without the trailing
+ * whitespace, or a negative errno
+ */
+static ssize_t read_attribute(int dir_fd, const char *name, char *buffer, size_t size)
+{
+    ssize_t len;
+    int fd;
+
+    fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+
+    len = read(fd, buffer, size - 1);
+    if (len < 0)
+        len = -errno;
+    close(fd);
+    if (len < 0)
+        return len;
+
+    while (len > 0 && (buffer[len - 1] == '\n' || buffer[len - 1] == ' '))
+        len--;
+    buffer[len] = '\0';
+
+    return len;
+}
+
+
+/* Devices on the SSB bus only mention the modalias in the uevent file */
+static ssize_t read_uevent_modalias(int dir_fd, char *buffer, size_t size)
+{
+    char uevent[4096];
+    char *line;
+    ssize_t len;
+
+    len = read_attribute(dir_fd, "uevent", uevent, sizeof(uevent));
+    if (len < 0)
+        return len;
+
+    for (line = uevent; line && *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL) {
+        if (strncmp(line, "MODALIAS=", 9) == 0) {
+            len = strcspn(line + 9, "\n");
+            while (len > 0 && line[9 + len - 1] == ' ')
+                len--;
+            if ((size_t)len >= size)
+                len = size - 1;
+            memcpy(buffer, line + 9, len);
+            buffer[len] = '\0';
+            return len;
+        }
+    }
+
+    return 0;
+}
+
+
+static bool is_symlink(int dir_fd, const char *name)
+{
+    char target[8];
+
+    return readlinkat(dir_fd, name, target, sizeof(target)) >= 0;
+}
+
+
+/* Add the modalias of the device at path, which is name in dir_fd */
+static int add_device_path(struct scan *scan, int dir_fd, const char *name,
+                           const char *path)
+{
+    char modalias[4096];
+    PyObject *key = NULL;
+    PyObject *value = NULL;
+    ssize_t len;
+    int device_fd;
+    int status = 0;
+
+    value = PyUnicode_DecodeFSDefault(path);
+    if (!value)
+        return -ENOMEM;
+    status = PySet_Contains(scan->seen, value);
+    if (status != 0) {
+        Py_DECREF(value);
+        return status < 0 ? -ENOMEM : 0;
+    }
+    if (PySet_Add(scan->seen, value) < 0) {
+        Py_DECREF(value);
+        return -ENOMEM;
+    }
+
+    device_fd = openat(dir_fd, name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (device_fd < 0)
+        goto out;
+    scan->found++;
+
+    /* Most devices have modalias files */
+    len = read_attribute(device_fd, "modalias", modalias, sizeof(modalias));
+    if (len == -ENOENT && strstr(path, "ssb"))
+        len = read_uevent_modalias(device_fd, modalias, sizeof(modalias));
+    if (len <= 0)
+        goto out;
+
+    /* Ignore drivers which are statically built into the kernel */
+    if (is_symlink(device_fd, "driver") && !is_symlink(device_fd, "driver/module"))
+        goto out;
+
+    key = PyUnicode_DecodeFSDefault(modalias);
+    if (!key || PyDict_SetItem(scan->aliases, key, value) < 0)
+        status = -ENOMEM;
+
+out:
+    if (device_fd >= 0)
+        close(device_fd);
+    Py_XDECREF(key);
+    Py_DECREF(value);
+    return status;
+}
+
+
+static int add_device(struct scan *scan, int dir_fd, const char *dir_path,
+                      const char *name)
+{
+    char path[PATH_MAX];
+    char target[PATH_MAX];
+    ssize_t len;
+
+    /* The entries are symlinks to the device, in the devices directory */
+    len = readlinkat(dir_fd, name, target, sizeof(target) - 1);
+    if (len < 0)
+        return 0;
+    target[len] = '\0';
+
+    if (target[0] == '/')
+        snprintf(path, sizeof(path), "%s", target);
+    else if (snprintf(path, sizeof(path), "%s/%s", dir_path, target) >= (int)sizeof(path))
+        return 0;
+    normalize_path(path);
+
+    if (strncmp(path, scan->devices, scan->devices_len) != 0 ||
+        path[scan->devices_len] != '/')
+        return 0;
+
+    return add_device_path(scan, dir_fd, name, path);
+}
+
+
+/* An entry of /sys/bus or /sys/class */
+static int add_subsystem(struct scan *scan, int dir_fd, const char *dir_path,
+                         const char *name)
+{
+    char path[PATH_MAX];
+    const char *devices = scan->bus ? "/devices" : "";
+    int fd;
+    int status;
+
+    /* Bus devices are in a directory of their own */
+    if (snprintf(path, sizeof(path), "%s/%s%s", dir_path, name, devices) >= (int)sizeof(path))
+        return 0;
+
+    fd = openat(dir_fd, path + strlen(dir_path) + 1, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+
+    status = for_each_entry(scan, fd, path, add_device);
+    close(fd);
+
+    /* Buses such as cpu also have a device at their root, which isn't
+     * listed with the others
+     */
+    if (status == 0 && scan->bus) {
+        if (snprintf(path, sizeof(path), "%s/system/%s", scan->devices, name) >= (int)sizeof(path))
+            return 0;
+        status = add_device_path(scan, AT_FDCWD, path, path);
+    }
+
+    return status;
+}
+
+
+static PyObject *system_modaliases(PyObject *self, PyObject *args)
+{
+    const char *sys_path = "/sys";
+    const char *subsystems[] = { "bus", "class" };
+    struct scan scan = { .found = 0 };
+    char path[PATH_MAX];
+    int status = 0;
+
+    (void)self;
+
+    if (!PyArg_ParseTuple(args, "|s", &sys_path))
+        return NULL;
+
+    snprintf(scan.devices, sizeof(scan.devices), "%s/devices", sys_path);
+    if (scan.devices[0] != '/') {
+        PyErr_SetString(PyExc_ValueError, "sys_path must be absolute");
+        return NULL;
+    }
+    normalize_path(scan.devices);
+    scan.devices_len = strlen(scan.devices);
+
+    scan.aliases = PyDict_New();
+    scan.seen = PySet_New(NULL);
+    if (!scan.aliases || !scan.seen)
+        goto error;
+
+    for (size_t i = 0; i < sizeof(subsystems) / sizeof(subsystems[0]); i++) {
+        int fd;
+
+        snprintf(path, sizeof(path), "%s/%s", sys_path, subsystems[i]);
+        normalize_path(path);
+        fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+
+        scan.bus = strcmp(subsystems[i], "bus") == 0;
+        status = for_each_entry(&scan, fd, path, add_subsystem);
+        close(fd);
+        if (status < 0)
+            break;
+    }
+
+    if (status < 0 && !PyErr_Occurred()) {
+        errno = -status;
+        PyErr_SetFromErrno(PyExc_OSError);
+    }
+    if (PyErr_Occurred())
+        goto error;
+
+    /* Nothing links to the devices, let the caller walk them */
+    if (!scan.found) {
+        errno = ENOENT;
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, scan.devices);
+        goto error;
+    }
+
+    Py_DECREF(scan.seen);
+    return scan.aliases;
+
+error:
+    Py_XDECREF(scan.aliases);
+    Py_XDECREF(scan.seen);
+    return NULL;
+}
+
+
+static PyMethodDef modaliases_methods[] = {
+    {"system_modaliases", system_modaliases, METH_VARARGS,
+     "system_modaliases(sys_path='/sys')\n\n"
+     "Return a modalias -> sysfs path map of the devices which are in a bus\n"
+     "or a class, like UbuntuDrivers.detect.system_modaliases()."},
+    {NULL, NULL, 0, NULL},
+};
+
+
+static struct PyModuleDef modaliases_module = {
+    PyModuleDef_HEAD_INIT,
+    "_modaliases",
+    "Fast modalias enumeration for UbuntuDrivers.detect",
+    -1,
+    modaliases_methods,
+    NULL, NULL, NULL, NULL,
+};
+
+
+PyMODINIT_FUNC PyInit__modaliases(void)
+{
+    return PyModule_Create(&modaliases_module);
+}
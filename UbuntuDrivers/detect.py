@@ -19,6 +19,11 @@ import apt
 
 from UbuntuDrivers import kerneldetection
 
+try:
+    from UbuntuDrivers import _modaliases
+except ImportError:
+    _modaliases = None
+
 system_architecture = apt.apt_pkg.get_architectures()[0]
 
 
@@ -30,6 +35,15 @@ def system_modaliases(sys_path=None):
 
     Return a modalias → sysfs path map.
     '''
+    # the native helper only looks at the devices in a bus or a class, and
+    # fails when there are none, e. g. on a fake sysfs
+    if _modaliases:
+        try:
+            return _modaliases.system_modaliases(sys_path or '/sys')
+        except (OSError, ValueError) as e:
+            logging.debug('system_modaliases(): native enumeration failed, '
+                          'walking the devices: %s', e)
+
     aliases = {}
     devices = sys_path and '%s/devices' % (sys_path) or '/sys/devices'
     for path, dirs, files in os.walk(devices):
@@ -1,6 +1,6 @@
 #!/usr/bin/python3
 
-from setuptools import setup
+from setuptools import setup, Extension
 
 import subprocess, glob, os.path
 import os
@@ -10,7 +10,9 @@ extra_data = []
 if '86' in os.uname()[4]:
     subprocess.check_call(["make", "-C", "share/hybrid", "all"])
     extra_data.append(("/usr/bin/", ["share/hybrid/gpu-manager"]))
-    extra_data.append(("/lib/systemd/system/", ["share/hybrid/gpu-manager.service"]))
+    extra_data.append(("/usr/lib/ubuntu-drivers-common/", ["share/hybrid/libgpumanager.so.1"]))
+    extra_data.append(("/lib/systemd/system/", ["share/hybrid/gpu-manager.service",
+                                                "share/hybrid/gpu-manager-watch.service"]))
     extra_data.append(("/sbin/", ["share/hybrid/u-d-c-print-pci-ids"]))
     extra_data.append(("/lib/udev/rules.d/", ["share/hybrid/71-u-d-c-gpu-detection.rules"]))
 
@@ -28,6 +30,7 @@ setup(
     license="gpl",
     description="Detect and install additional Ubuntu driver packages",
     packages=["NvidiaDetector", "Quirks", "UbuntuDrivers"],
+    ext_modules=[Extension("UbuntuDrivers._modaliases", ["UbuntuDrivers/_modaliases.c"])],
     data_files=[("/usr/share/ubuntu-drivers-common/", ["share/obsolete", "share/fake-devices-wrapper"]),
                 ("/var/lib/ubuntu-drivers-common/", []),
                 ("/usr/share/ubuntu-drivers-common/quirks", glob.glob("quirks/*")),
@@ -0,0 +1,179 @@
+/* libgpumanager:
+ *
+ * Detect the available GPUs and deal with any system changes, from a
+ * program other than gpu-manager.
+ *
+ * Copyright (C) 2014 Canonical Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of the copyright holder(s)
+ * and author(s) shall not be used in advertising or otherwise to promote
+ * the sale, use or other dealings in this Software without prior written
+ * authorization from the copyright holder(s) and author(s).
+ */
+
+#ifndef GPU_MANAGER_H
+#define GPU_MANAGER_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* All the settings, the logger and the probed devices live in a context.
+ *
+ * The library is not reentrant: each call loads the settings of its
+ * context into process-wide state, and the GPU policies and quirks are
+ * cached there too. Only make one call at a time, from one thread,
+ * whatever the context.
+ *
+ * The library is private to gpu-manager and installed in
+ * /usr/lib/ubuntu-drivers-common, without this header: the API can
+ * change with any release.
+ */
+struct gpu_manager_context;
+
+/* The levels of the log lines, as syslog priorities */
+enum gpu_manager_log_level {
+    GPU_MANAGER_LOG_ERR = 3,
+    GPU_MANAGER_LOG_WARNING = 4,
+    GPU_MANAGER_LOG_INFO = 6,
+    GPU_MANAGER_LOG_DEBUG = 7,
+};
+
+/* Called with each line of the log, without the newline */
+typedef void (*gpu_manager_log_func)(enum gpu_manager_log_level level,
+                                     const char *line, void *data);
+
+enum gpu_manager_action {
+    GPU_MANAGER_ACTION_NONE,
+    GPU_MANAGER_ACTION_PRIME,
+    GPU_MANAGER_ACTION_AMDGPU_PRO_POWERSAVING,
+    GPU_MANAGER_ACTION_AMDGPU_PRO_RESET,
+    GPU_MANAGER_ACTION_REMOVE_OFFLOAD,
+};
+
+enum gpu_manager_prime_mode {
+    GPU_MANAGER_PRIME_ON,
+    GPU_MANAGER_PRIME_OFF,
+    GPU_MANAGER_PRIME_ON_DEMAND,
+};
+
+struct gpu_manager_gpu {
+    unsigned int vendor_id;
+    unsigned int device_id;
+    unsigned int domain;
+    unsigned int bus;
+    unsigned int dev;
+    unsigned int func;
+    bool boot_vga;
+    /* -1 if unknown */
+    int numa_node;
+    /* PCIe link speed in MT/s, and width. 0 if unknown */
+    unsigned int cur_link_speed;
+    unsigned int cur_link_width;
+    unsigned int max_link_speed;
+    unsigned int max_link_width;
+    bool link_degraded;
+};
+
+struct gpu_manager_decision {
+    long long timestamp;
+    enum gpu_manager_action action;
+    enum gpu_manager_prime_mode prime_mode;
+    bool offloading;
+    /* PCI address of the discrete GPU used for PRIME, or empty */
+    char discrete[32];
+};
+
+/* Create a context with the default settings. Return NULL on failure */
+struct gpu_manager_context *gpu_manager_context_new(void);
+void gpu_manager_context_free(struct gpu_manager_context *ctx);
+
+/* Set one of the settings, by the name of the matching gpu-manager option
+ * (e.g. "last-boot-file"). Options without a value, such as "no-wake",
+ * take NULL, or a boolean such as "1" or "no". Return 0, or -EINVAL for
+ * unknown names or invalid values.
+ *
+ * gpu_manager_run() lets "gpumanager.<option>=<value>" kernel parameters
+ * override the runtime settings: the PRIME mode ("mode"), the deadlines,
+ * and the power management and module load settings. Paths and test
+ * settings can't be changed from there.
+ */
+int gpu_manager_context_set_option(struct gpu_manager_context *ctx,
+                                   const char *name, const char *value);
+void gpu_manager_context_set_logger(struct gpu_manager_context *ctx,
+                                    gpu_manager_log_func func, void *data);
+void gpu_manager_context_set_dry_run(struct gpu_manager_context *ctx, bool dry_run);
+
+/* Probe the GPUs, or reuse the ones probed by an earlier call unless
+ * refresh is true. Return the number of GPUs, or a negative errno.
+ */
+int gpu_manager_inventory(struct gpu_manager_context *ctx, bool refresh);
+int gpu_manager_get_gpu(struct gpu_manager_context *ctx, int index,
+                        struct gpu_manager_gpu *gpu);
+
+/* Decide what to do with the probed GPUs, without changing the system.
+ * Return 0, -ENODEV without a boot VGA, or another negative errno.
+ */
+int gpu_manager_decide(struct gpu_manager_context *ctx,
+                       struct gpu_manager_decision *decision);
+
+/* Carry out a decision, and record the GPUs and the decision for the
+ * next run. The decision is updated with what was actually done.
+ */
+int gpu_manager_apply(struct gpu_manager_context *ctx,
+                      struct gpu_manager_decision *decision);
+
+/* What gpu-manager does at boot: inventory, decision and apply.
+ *
+ * If probing the system takes more than the "deadline-ms" setting, the
+ * last decision is applied instead and -ETIMEDOUT is returned. Probing
+ * runs in a child process, which is killed then, and which the calling
+ * process shares nothing with: the context can be used as usual after.
+ */
+int gpu_manager_run(struct gpu_manager_context *ctx);
+
+/* Apply the changes to the PRIME settings, and restore the xorg.conf.d
+ * snippets of the current mode, as they happen. Returns 0 at once if
+ * the last decision wasn't PRIME, and otherwise only on errors.
+ */
+int gpu_manager_watch(struct gpu_manager_context *ctx);
+
+/* Reports from the state recorded by the last run */
+int gpu_manager_export_metrics(struct gpu_manager_context *ctx);
+int gpu_manager_print_inventory(struct gpu_manager_context *ctx, FILE *file);
+int gpu_manager_print_status(struct gpu_manager_context *ctx, FILE *file,
+                             bool json, bool refresh);
+int gpu_manager_print_journal(struct gpu_manager_context *ctx, FILE *file,
+                              long long since, long long until);
+
+/* Decide for each scenario read from input, one per line, in the
+ * format described at simulate() in libgpumanager.c
+ */
+int gpu_manager_simulate(struct gpu_manager_context *ctx, FILE *input, FILE *output);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GPU_MANAGER_H */
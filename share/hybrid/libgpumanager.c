@@ -0,0 +1,5899 @@
+/* libgpumanager:
+ *
+ * Detect the available GPUs and deal with any system changes, whether
+ * software or hardware related
+ *
+ * Authored by:
+ *   Alberto Milone
+ *
+ *
+ * Copyright (C) 2014 Canonical Ltd
+ *
+ * Based on code from ./hw/xfree86/common/xf86pciBus.c in xorg-server
+ * Also based on hybrid-detect.c in ubuntu-drivers-common.
+ *
+ * Copyright (c) 1997-2003 by The XFree86 Project, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of the copyright holder(s)
+ * and author(s) shall not be used in advertising or otherwise to promote
+ * the sale, use or other dealings in this Software without prior written
+ * authorization from the copyright holder(s) and author(s).
+ *
+ *
+ * Build with `gcc -shared -fPIC -Wl,-soname,libgpumanager.so.1 -pthread -o libgpumanager.so.1 libgpumanager.c $(pkg-config --cflags pciaccess libdrm libkmod) -ldl`
+ */
+
+#define _GNU_SOURCE
+
+#include <libkmod.h>
+#include <pciaccess.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <inttypes.h>
+#include <linux/limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "gpu-manager.h"
+
+static const char *LAST_BOOT = "/var/lib/ubuntu-drivers-common/last_gfx_boot";
+static const char *OFFLOADING_CONF = "/var/lib/ubuntu-drivers-common/requires_offloading";
+static const char *KERN_PARAM = "nogpumanager";
+static const char *AMDGPU_PRO_PX = "/opt/amdgpu-pro/bin/amdgpu-pro-px";
+static const char *LAST_DECISION = "/var/lib/ubuntu-drivers-common/last_gfx_decision";
+static const char *JOURNAL = "/var/lib/ubuntu-drivers-common/gfx_journal";
+
+typedef enum {
+    AMD = 0x1002,
+    INTEL = 0x8086,
+    NVIDIA = 0x10DE,
+} vendor;
+
+typedef enum {
+    MODE_POWERSAVING,
+    MODE_PERFORMANCE,
+    RESET,
+    ISPX,
+} amdgpu_pro_px_action;
+
+typedef enum {
+    ON,
+    OFF,
+    ONDEMAND
+} prime_mode_settings;
+
+/* Links trained below their maximum width. The speed isn't tracked, as
+ * GPUs lower it when idle. Bits 1 and 3 were used for the speed, and
+ * are ignored in the files of older versions.
+ */
+typedef enum {
+    LINK_WIDTH_DEGRADED = 1 << 0,
+    BRIDGE_WIDTH_DEGRADED = 1 << 2,
+} link_health_flags;
+
+typedef enum {
+    ACTION_NONE,
+    ACTION_PRIME,
+    ACTION_AMDGPU_PRO_POWERSAVING,
+    ACTION_AMDGPU_PRO_RESET,
+    ACTION_REMOVE_OFFLOAD,
+} decision_action;
+
+static FILE *log_handle = NULL;
+static char *last_boot_file = NULL;
+static char *fake_modules_path = NULL;
+static char *gpu_detection_path = NULL;
+static char *dmi_product_name_path = NULL;
+static char *dmi_product_version_path = NULL;
+static char *amdgpu_pro_px_file = NULL;
+static char *modprobe_d_path = NULL;
+static char *xorg_conf_d_path = NULL;
+static char *fake_lspci_file = NULL;
+static char *new_boot_file = NULL;
+static char *prime_settings = NULL;
+static char *last_decision_file = NULL;
+static char *metrics_textfile = NULL;
+static char *discrete_bdf = NULL;
+static char *journal_file = NULL;
+static char *cmdline_file = NULL;
+static char *prime_mode_override = NULL;
+static char *policy_file = NULL;
+static char *quirks_file = NULL;
+
+static int dry_run = 0;
+static int fake_offloading = 0;
+static int fake_module_available = 0;
+static int fake_module_versioned = 0;
+static int no_wake = 1;
+static int full_pci_scan = 0;
+static int pm_siblings = 1;
+static int autosuspend_delay_ms = -1;
+static int pm_verify_timeout_ms = -1;
+static int deadline_ms = 5000;
+static int probe_budget_ms = 2000;
+static int speculative_load = 0;
+static int watch_debounce_ms = 250;
+
+
+/* Log at the given level. The level goes before the line as "<level>",
+ * for write_log() to take it off again
+ */
+__attribute__((format(printf, 2, 3)))
+static void log_msg(enum gpu_manager_log_level level, const char *format, ...)
+{
+    va_list args;
+
+    flockfile(log_handle);
+    fprintf(log_handle, "<%d>", level);
+    va_start(args, format);
+    vfprintf(log_handle, format, args);
+    va_end(args);
+    funlockfile(log_handle);
+}
+
+struct device {
+    int boot_vga;
+    vendor vendor_id;
+    unsigned int device_id;
+    /* BusID components */
+    unsigned int domain;
+    unsigned int bus;
+    unsigned int dev;
+    unsigned int func;
+    int has_connected_outputs;
+    /* Topology, from sysfs. -1, 0 or empty if unknown */
+    int numa_node;
+    char local_cpulist[64];
+    /* PCIe link speed in MT/s, and width */
+    unsigned int cur_link_speed;
+    unsigned int cur_link_width;
+    unsigned int max_link_speed;
+    unsigned int max_link_width;
+    unsigned long long bar_size[6];
+    /* link_health_flags */
+    int link_health;
+};
+
+#define NR_BARS (sizeof(((struct device *)0)->bar_size) / sizeof(unsigned long long))
+
+#define MAX_NR_CARDS 10
+
+struct gpus {
+    struct device *cards[MAX_NR_CARDS];
+    int nr_cards;
+    /* Devices which belong to virtual machines */
+    char passthrough[MAX_NR_CARDS][32];
+    int nr_passthrough;
+};
+
+/* What was decided, and applied, in the last run */
+struct decision {
+    time_t timestamp;
+    decision_action action;
+    prime_mode_settings prime_mode;
+    int offloading;
+    char discrete[32];
+};
+
+/* The journal is a ring of fixed size records, one per run, after a
+ * header which tells where the next record goes.
+ */
+#define JOURNAL_MAGIC 0x4a4d4721 /* "!GMJ" */
+#define JOURNAL_VERSION 1
+#define JOURNAL_CAPACITY 1024
+#define JOURNAL_MAX_CARDS 4
+
+struct journal_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t capacity;
+    /* Slot of the next record, and number of valid records */
+    uint32_t head;
+    uint32_t count;
+};
+
+struct journal_record {
+    int64_t timestamp;
+    /* Duration of the run */
+    uint32_t duration_ms;
+    /* Hash of the ids and of the BusIDs of the cards */
+    uint32_t fingerprint;
+    uint8_t action;
+    uint8_t prime_mode;
+    uint8_t offloading;
+    uint8_t nr_cards;
+    uint16_t ids[JOURNAL_MAX_CARDS][2];
+    char release[48];
+    char discrete[32];
+    uint8_t reserved[12];
+};
+
+_Static_assert(sizeof(struct journal_record) == 128, "journal records must be 128 bytes");
+
+/* What the decision depends on, apart from the devices */
+struct system_state {
+    bool nvidia_loaded;
+    bool nvidia_unloaded;
+    bool intel_loaded;
+    bool amdgpu_loaded;
+    bool nouveau_loaded;
+    bool nvidia_kmod_available;
+    bool amdgpu_is_pro;
+    bool amdgpu_pro_px_installed;
+    int offloading;
+    bool has_changed;
+    /* Whether the ServerLayout for offloading is in xorg_conf_d_path */
+    bool has_offload_layout;
+    /* The mode in the PRIME settings */
+    prime_mode_settings prime_mode;
+    /* Whether to look for the cards disabled by bbswitch */
+    bool find_disabled_cards;
+};
+
+#define MAX_NR_DRM_CARDS 16
+
+struct drm_card {
+    char name[NAME_MAX + 1];
+    char driver[64];
+    int connected_outputs;
+};
+
+struct drm_cards {
+    struct drm_card cards[MAX_NR_DRM_CARDS];
+    int nr_cards;
+};
+
+
+static inline void freep(void *p)
+{
+    free(*(void **)p);
+}
+#define _cleanup_free_ __attribute__((cleanup(freep)))
+
+static inline void fclosep(FILE **file)
+{
+    if (*file != NULL && fileno(*file) >= 0)
+        fclose(*file);
+}
+#define _cleanup_fclose_ __attribute__((cleanup(fclosep)))
+
+
+/* libpciaccess, libdrm and libkmod are only needed by some of the probes,
+ * and most runs end up not using one or more of them, so they are
+ * dlopen()ed the first time they are needed, unless gpu-manager is built
+ * with STATIC_BACKENDS.
+ */
+static struct {
+    int (*system_init)(void);
+    void (*system_cleanup)(void);
+    struct pci_device_iterator *(*slot_match_iterator_create)(const struct pci_slot_match *match);
+    struct pci_device *(*device_next)(struct pci_device_iterator *iter);
+    int (*device_is_boot_vga)(struct pci_device *dev);
+} pci_api;
+
+static struct {
+    drmVersionPtr (*get_version)(int fd);
+    void (*free_version)(drmVersionPtr version);
+} drm_api;
+
+static struct {
+    struct kmod_ctx *(*new)(const char *dirname, const char * const *config_paths);
+    struct kmod_ctx *(*unref)(struct kmod_ctx *ctx);
+    int (*module_new_from_name)(struct kmod_ctx *ctx, const char *name, struct kmod_module **mod);
+    struct kmod_module *(*module_unref)(struct kmod_module *mod);
+    int (*module_get_info)(const struct kmod_module *mod, struct kmod_list **list);
+    const char *(*module_info_get_key)(const struct kmod_list *entry);
+    const char *(*module_info_get_value)(const struct kmod_list *entry);
+    void (*module_info_free_list)(struct kmod_list *list);
+    struct kmod_list *(*list_next)(const struct kmod_list *list, const struct kmod_list *curr);
+} kmod_api;
+
+#ifdef STATIC_BACKENDS
+#define LOAD_SYMBOL(handle, field, symbol) (field = symbol)
+#else
+/* See dlsym(3) about the cast */
+#define LOAD_SYMBOL(handle, field, symbol) (*(void **)(&field) = dlsym(handle, #symbol))
+#endif
+
+/* Load a library once. Return NULL if that failed, now or before */
+static void *open_backend(const char *soname, void **handle, bool *failed)
+{
+#ifdef STATIC_BACKENDS
+    (void)soname;
+    (void)failed;
+    return handle;
+#else
+    if (*handle || *failed)
+        return *handle;
+
+    *handle = dlopen(soname, RTLD_NOW | RTLD_LOCAL);
+    if (!*handle) {
+        *failed = true;
+        log_msg(GPU_MANAGER_LOG_ERR, "Error: can't load %s: %s\n", soname, dlerror());
+    }
+    return *handle;
+#endif
+}
+
+
+static bool load_pciaccess(void)
+{
+    static void *handle;
+    static bool failed;
+    void *lib = open_backend("libpciaccess.so.0", &handle, &failed);
+
+    if (!lib || pci_api.system_init)
+        return lib != NULL;
+
+    if (!LOAD_SYMBOL(lib, pci_api.system_init, pci_system_init) ||
+        !LOAD_SYMBOL(lib, pci_api.system_cleanup, pci_system_cleanup) ||
+        !LOAD_SYMBOL(lib, pci_api.slot_match_iterator_create, pci_slot_match_iterator_create) ||
+        !LOAD_SYMBOL(lib, pci_api.device_next, pci_device_next) ||
+        !LOAD_SYMBOL(lib, pci_api.device_is_boot_vga, pci_device_is_boot_vga)) {
+        log_msg(GPU_MANAGER_LOG_ERR, "Error: libpciaccess lacks a symbol\n");
+        memset(&pci_api, 0, sizeof(pci_api));
+        failed = true;
+        return false;
+    }
+    return true;
+}
+
+
+static bool load_drm(void)
+{
+    static void *handle;
+    static bool failed;
+    void *lib = open_backend("libdrm.so.2", &handle, &failed);
+
+    if (!lib || drm_api.get_version)
+        return lib != NULL;
+
+    if (!LOAD_SYMBOL(lib, drm_api.get_version, drmGetVersion) ||
+        !LOAD_SYMBOL(lib, drm_api.free_version, drmFreeVersion)) {
+        log_msg(GPU_MANAGER_LOG_ERR, "Error: libdrm lacks a symbol\n");
+        memset(&drm_api, 0, sizeof(drm_api));
+        failed = true;
+        return false;
+    }
+    return true;
+}
+
+
+static bool load_kmod(void)
+{
+    static void *handle;
+    static bool failed;
+    void *lib = open_backend("libkmod.so.2", &handle, &failed);
+
+    if (!lib || kmod_api.new)
+        return lib != NULL;
+
+    if (!LOAD_SYMBOL(lib, kmod_api.new, kmod_new) ||
+        !LOAD_SYMBOL(lib, kmod_api.unref, kmod_unref) ||
+        !LOAD_SYMBOL(lib, kmod_api.module_new_from_name, kmod_module_new_from_name) ||
+        !LOAD_SYMBOL(lib, kmod_api.module_unref, kmod_module_unref) ||
+        !LOAD_SYMBOL(lib, kmod_api.module_get_info, kmod_module_get_info) ||
+        !LOAD_SYMBOL(lib, kmod_api.module_info_get_key, kmod_module_info_get_key) ||
+        !LOAD_SYMBOL(lib, kmod_api.module_info_get_value, kmod_module_info_get_value) ||
+        !LOAD_SYMBOL(lib, kmod_api.module_info_free_list, kmod_module_info_free_list) ||
+        !LOAD_SYMBOL(lib, kmod_api.list_next, kmod_list_next)) {
+        log_msg(GPU_MANAGER_LOG_ERR, "Error: libkmod lacks a symbol\n");
+        memset(&kmod_api, 0, sizeof(kmod_api));
+        failed = true;
+        return false;
+    }
+    return true;
+}
+
+
+static bool starts_with(const char *string, const char *prefix) {
+    size_t prefix_len = strlen(prefix);
+    size_t string_len = strlen(string);
+    return string_len < prefix_len ? 0 : strncmp(prefix, string, prefix_len) == 0;
+}
+
+
+/* Case insensitive equivalent of strstr */
+static const char *istrstr(const char *str1, const char *str2) {
+    if (!*str2)
+    {
+      return str1;
+    }
+    for (; *str1; ++str1) {
+        /* Look for the 1st character */
+        if (toupper(*str1) == toupper(*str2)) {
+            /* We have a match. Let's loop through the
+             * remaining characters.
+             * chr1 belongs to str1, whereas chr2 belongs to str2.
+             */
+            const char *chr1, *chr2;
+            for (chr1 = str1, chr2 = str2; *chr1 && *chr2; ++chr1, ++chr2) {
+                if (toupper(*chr1) != toupper(*chr2)) {
+                    break;
+                }
+            }
+            /* If we have matched all of str2 and we have arrived
+             * at NULL termination, then we're done.
+             * Let's return str1.
+             */
+            if (!*chr2) {
+                return str1;
+            }
+        }
+    }
+    return NULL;
+}
+
+
+static bool exists_not_empty(const char *file) {
+    struct stat stbuf;
+
+    /* If file doesn't exist */
+    if (stat(file, &stbuf) == -1) {
+        log_msg(GPU_MANAGER_LOG_DEBUG, "can't access %s\n", file);
+        return false;
+    }
+    /* If file is empty */
+    if ((stbuf.st_mode & S_IFMT) && ! stbuf.st_size) {
+        log_msg(GPU_MANAGER_LOG_DEBUG, "%s is empty\n", file);
+        return false;
+    }
+    return true;
+}
+
+/* How long external commands may run. Loading nvidia can take a while */
+#define COMMAND_TIMEOUT_MS 5000
+#define MODULE_TIMEOUT_MS 30000
+#define AMDGPU_PRO_PX_TIMEOUT_MS 30000
+/* How long a command has to exit after SIGTERM, before SIGKILL */
+#define COMMAND_KILL_GRACE_MS 1000
+#define MAX_COMMAND_OUTPUT 65536
+
+extern char **environ;
+
+static long long get_monotonic_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+/* The boot watchdog: the system is probed, and the decision taken, in a
+ * child process, which mustn't take more than deadline_ms, or
+ * probe_budget_ms for a single probe. If it stalls, it's killed and the
+ * last decision is applied instead, so that nothing the child uses is
+ * shared with us. Applying the decision isn't covered, as each command
+ * there has a timeout.
+ */
+struct watchdog_probe {
+    /* When the probe in progress began, or 0 */
+    long long start;
+    char name[32];
+};
+
+/* In memory shared with the parent, in the probing child only */
+static struct watchdog_probe *watchdog_probe = NULL;
+
+
+static void begin_probe(const char *name)
+{
+    if (!watchdog_probe)
+        return;
+
+    snprintf(watchdog_probe->name, sizeof(watchdog_probe->name), "%s", name);
+    __atomic_store_n(&watchdog_probe->start, get_monotonic_ms(), __ATOMIC_RELEASE);
+}
+
+
+static void end_probe(void)
+{
+    if (watchdog_probe)
+        __atomic_store_n(&watchdog_probe->start, 0, __ATOMIC_RELEASE);
+}
+
+
+/* Wait for the child until the deadline. Return false if it's still running */
+static bool wait_for_child(pid_t pid, int *wstatus, long long deadline)
+{
+    while (true) {
+        pid_t ret = waitpid(pid, wstatus, WNOHANG);
+
+        if (ret == pid || (ret < 0 && errno != EINTR))
+            return true;
+        if (get_monotonic_ms() >= deadline)
+            return false;
+        poll(NULL, 0, 10);
+    }
+}
+
+
+/* Run a program with the arguments in argv, without a shell, and with
+ * stdin from /dev/null. If output is not NULL, stdout is captured there,
+ * and must be freed. If the program doesn't exit within timeout_ms, it
+ * gets SIGTERM and then SIGKILL.
+ *
+ * Return the exit status, -ETIMEDOUT, or another negative errno if the
+ * program couldn't be run or was killed by a signal.
+ */
+static int run_command(char *const argv[], int timeout_ms, char **output)
+{
+    posix_spawn_file_actions_t actions;
+    long long deadline = get_monotonic_ms() + timeout_ms;
+    int pipe_fds[2] = { -1, -1 };
+    size_t len = 0;
+    int wstatus = 0;
+    bool timed_out = false;
+    pid_t pid;
+    int ret;
+
+    if (output) {
+        *output = NULL;
+        if (pipe2(pipe_fds, O_CLOEXEC) != 0)
+            return -errno;
+    }
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    if (output)
+        posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDOUT_FILENO);
+
+    ret = posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (output)
+        close(pipe_fds[1]);
+
+    if (ret != 0) {
+        log_msg(GPU_MANAGER_LOG_ERR, "Error: can't run %s: %s\n", argv[0], strerror(ret));
+        if (output)
+            close(pipe_fds[0]);
+        return -ret;
+    }
+
+    /* Read the output until the child closes stdout */
+    while (output && pipe_fds[0] >= 0) {
+        struct pollfd pfd = { .fd = pipe_fds[0], .events = POLLIN };
+        long long remaining = deadline - get_monotonic_ms();
+        char *buffer;
+        ssize_t size;
+
+        if (remaining <= 0) {
+            timed_out = true;
+            break;
+        }
+        if (poll(&pfd, 1, (int)remaining) <= 0)
+            continue;
+
+        buffer = realloc(*output, len + 4096 + 1);
+        if (!buffer)
+            break;
+        *output = buffer;
+        (*output)[len] = '\0';
+
+        size = read(pipe_fds[0], *output + len, 4096);
+        if (size < 0 && errno == EINTR)
+            continue;
+        if (size <= 0)
+            break;
+        len = len + size < MAX_COMMAND_OUTPUT ? len + size : MAX_COMMAND_OUTPUT;
+        (*output)[len] = '\0';
+    }
+    if (output)
+        close(pipe_fds[0]);
+
+    if (timed_out || !wait_for_child(pid, &wstatus, deadline)) {
+        timed_out = true;
+        log_msg(GPU_MANAGER_LOG_ERR, "Error: %s timed out after %d ms, terminating it\n",
+                argv[0], timeout_ms);
+        kill(pid, SIGTERM);
+        if (!wait_for_child(pid, &wstatus, get_monotonic_ms() + COMMAND_KILL_GRACE_MS)) {
+            kill(pid, SIGKILL);
+            waitpid(pid, &wstatus, 0);
+        }
+    }
+
+    if (timed_out)
+        return -ETIMEDOUT;
+    if (WIFEXITED(wstatus))
+        return WEXITSTATUS(wstatus);
+
+    log_msg(GPU_MANAGER_LOG_ERR, "Error: %s was killed by signal %d\n", argv[0], WTERMSIG(wstatus));
+    return -EINTR;
+}
+
+
+static bool act_upon_module_with_params(const char *module,
+                                       int mode,
+                                       char *params) {
+    char *argv[16];
+    int argc = 0;
+    char *saveptr = NULL;
+    bool status = true;
+
+    log_msg(GPU_MANAGER_LOG_INFO, "%s %s with \"%s\" parameters\n",
+            mode ? "Loading" : "Unloading",
+            module, params ? params : "no");
+
+    argv[argc++] = mode ? "/sbin/modprobe" : "/sbin/rmmod";
+    argv[argc++] = (char *)module;
+    if (params) {
+        for (char *param = strtok_r(params, " \t\n", &saveptr);
+             param && argc < (int)(sizeof(argv) / sizeof(argv[0])) - 1;
+             param = strtok_r(NULL, " \t\n", &saveptr))
+            argv[argc++] = param;
+    }
+    argv[argc] = NULL;
+
+    if (!dry_run)
+        status = run_command(argv, MODULE_TIMEOUT_MS, NULL) == 0;
+
+    free(params);
+
+    return status;
+}
+
+static bool load_module_with_params(const char *module, char *params)
+{
+    return act_upon_module_with_params(module, 1, params);
+}
+
+static bool load_module(const char *module)
+{
+    return load_module_with_params(module, NULL);
+}
+
+static bool unload_module(const char *module)
+{
+    return act_upon_module_with_params(module, 0, NULL);
+}
+
+
+/* Get the first match from the output of a command */
+static char* get_output(char *const argv[], const char *pattern, const char *ignore) {
+    _cleanup_free_ char *lines = NULL;
+    char *saveptr = NULL;
+
+    if (run_command(argv, COMMAND_TIMEOUT_MS, &lines) < 0 || !lines)
+        return NULL;
+
+    for (char *line = strtok_r(lines, "\n", &saveptr); line;
+         line = strtok_r(NULL, "\n", &saveptr)) {
+        /* If no search pattern was provided, just
+         * return the first non zero legth line
+         */
+        if (!pattern)
+            return strdup(line);
+
+        /* Look for the search pattern */
+        if (ignore && (strstr(line, ignore) != NULL)) {
+            /* Skip this line */
+            continue;
+        }
+        /* Look for the pattern */
+        if (strstr(line, pattern) != NULL)
+            return strdup(line);
+    }
+
+    return NULL;
+}
+
+
+/* Look for the pattern in the files matching the glob, with grep */
+static char *grep_files(const char *regex, const char *files)
+{
+    glob_t matches;
+    char **argv;
+    char *output = NULL;
+
+    if (glob(files, 0, NULL, &matches) != 0)
+        return NULL;
+
+    argv = calloc(matches.gl_pathc + 4, sizeof(*argv));
+    if (argv) {
+        argv[0] = "grep";
+        argv[1] = "-G";
+        argv[2] = (char *)regex;
+        memcpy(argv + 3, matches.gl_pathv, matches.gl_pathc * sizeof(*argv));
+        output = get_output(argv, NULL, NULL);
+        free(argv);
+    }
+    globfree(&matches);
+
+    return output;
+}
+
+
+static bool is_module_blacklisted(const char* module) {
+    _cleanup_free_ char *match = NULL;
+    char regex[100];
+    char files[PATH_MAX];
+
+    /* It will be a file if it's a test */
+    if (dry_run) {
+        snprintf(regex, sizeof(regex), "blacklist.*%s[[:space:]]*$", module);
+
+        if (exists_not_empty(modprobe_d_path))
+            match = grep_files(regex, modprobe_d_path);
+    }
+    else {
+        snprintf(regex, sizeof(regex), "^blacklist.*%s[[:space:]]*$", module);
+        snprintf(files, sizeof(files), "%s/*.conf", modprobe_d_path);
+
+        match = grep_files(regex, files);
+
+        if (!match)
+            match = grep_files(regex, "/lib/modprobe.d/*.conf");
+    }
+
+    if (!match)
+        return false;
+    return true;
+}
+
+
+static bool is_module_loaded(const char *module)
+{
+    bool status = false;
+    char line[4096];
+    _cleanup_fclose_ FILE *file = NULL;
+
+    if (!fake_modules_path)
+        file = fopen("/proc/modules", "r");
+    else
+        file = fopen(fake_modules_path, "r");
+
+    if (!file) {
+        log_msg(GPU_MANAGER_LOG_ERR, "Error: can't open /proc/modules\n");
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        char *tok;
+        tok = strtok(line, " \t");
+        if (strcmp(tok, module) == 0) {
+            status = true;
+            break;
+        }
+    }
+
+    return status;
+}
+
+static bool is_file(char *file)
+{
+    struct stat stbuf;
+
+    if (stat(file, &stbuf) == -1) {
+        log_msg(GPU_MANAGER_LOG_DEBUG, "can't access %s file\n", file);
+        return false;
+    }
+    if (stbuf.st_mode & S_IFMT)
+        return true;
+
+    return false;
+}
+
+/* Look for unloaded modules */
+static bool has_unloaded_module(char *module) {
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/u-d-c-%s-was-loaded",
+             gpu_detection_path, module);
+
+    if (is_file(path) && !is_module_loaded(module)) {
+        log_msg(GPU_MANAGER_LOG_INFO, "%s was unloaded\n", module);
+        return true;
+    }
+
+    return false;
+}
+
+
+#define MAX_CMDLINE_PARAMS 256
+
+/* The kernel command line, read once and split into parameters. Values
+ * are NULL for parameters without "="
+ */
+static struct {
+    char *path;
+    char *buffer;
+    size_t nr_params;
+    struct cmdline_param {
+        const char *key;
+        const char *value;
+    } params[MAX_CMDLINE_PARAMS];
+} cmdline;
+
+
+/* Split the command line in place, the way the kernel does: parameters
+ * are separated by spaces, double quotes protect spaces and are removed,
+ * and everything after "--" belongs to init
+ */
+static void split_cmdline(char *buffer)
+{
+    char *next = buffer;
+
+    cmdline.nr_params = 0;
+    while (*next && cmdline.nr_params < MAX_CMDLINE_PARAMS) {
+        struct cmdline_param *param;
+        bool in_quotes = false;
+        char *start, *out, *equal = NULL;
+
+        while (isspace((unsigned char)*next))
+            next++;
+        if (!*next)
+            break;
+
+        start = out = next;
+        for (; *next && (in_quotes || !isspace((unsigned char)*next)); next++) {
+            if (*next == '"')
+                in_quotes = !in_quotes;
+            else {
+                if (*next == '=' && !equal)
+                    equal = out;
+                *out++ = *next;
+            }
+        }
+        if (*next)
+            next++;
+        *out = '\0';
+
+        if (strcmp(start, "--") == 0)
+            break;
+
+        param = &cmdline.params[cmdline.nr_params++];
+        param->key = start;
+        param->value = NULL;
+        if (equal) {
+            *equal = '\0';
+            param->value = equal + 1;
+        }
+    }
+}
+
+
+/* Read the command line unless it was already read from the same path */
+static void load_cmdline(const char *path)
+{
+    _cleanup_fclose_ FILE *file = NULL;
+    size_t len = 0;
+
+    if (cmdline.path && strcmp(cmdline.path, path) == 0)
+        return;
+
+    free(cmdline.path);
+    free(cmdline.buffer);
+    cmdline.buffer = NULL;
+    cmdline.nr_params = 0;
+    cmdline.path = strdup(path);
+
+    file = fopen(path, "r");
+    if (!file)
+        return;
+    if (getline(&cmdline.buffer, &len, file) == -1) {
+        free(cmdline.buffer);
+        cmdline.buffer = NULL;
+        return;
+    }
+    split_cmdline(cmdline.buffer);
+}
+
+
+/* Return the parameter with exactly this name, or NULL */
+static const struct cmdline_param *get_cmdline_param(const char *key)
+{
+    load_cmdline(cmdline_file);
+
+    for (size_t i = 0; i < cmdline.nr_params; i++) {
+        if (strcmp(cmdline.params[i].key, key) == 0)
+            return &cmdline.params[i];
+    }
+
+    return NULL;
+}
+
+
+static bool has_cmdline_option(const char *option)
+{
+    return get_cmdline_param(option) != NULL;
+}
+
+
+static bool is_disabled_in_cmdline() {
+    return has_cmdline_option(KERN_PARAM);
+}
+
+static void report_prime_intel_driver(void)
+{
+    if (has_cmdline_option("gpumanager_modesetting")) {
+        log_msg(GPU_MANAGER_LOG_INFO, "Detected boot parameter to force the modesetting driver\n");
+    }
+    else if (has_cmdline_option("gpumanager_uxa")) {
+        log_msg(GPU_MANAGER_LOG_INFO, "Detected boot parameter to force Intel/UXA\n");
+    }
+    else if (has_cmdline_option("gpumanager_sna")) {
+        log_msg(GPU_MANAGER_LOG_INFO, "Detected boot parameter to force Intel/SNA\n");
+    }
+    else {
+        log_msg(GPU_MANAGER_LOG_INFO, "No boot parameter to force Intel: Using modesetting driver\n");
+    }
+}
+
+
+/* Read the first line of a sysfs attribute, without the trailing newline */
+static bool read_sysfs_attribute(const char *path, char *buf, size_t size) {
+    _cleanup_fclose_ FILE *file = NULL;
+    size_t len;
+
+    file = fopen(path, "r");
+    if (!file)
+        return false;
+
+    if (!fgets(buf, size, file))
+        return false;
+
+    len = strlen(buf);
+    if (len > 0 && buf[len - 1] == '\n')
+        buf[len - 1] = '\0';
+
+    return true;
+}
+
+
+static const char *prime_mode_to_string(prime_mode_settings mode)
+{
+    switch (mode) {
+    case ON:
+        return "on";
+    case ONDEMAND:
+        return "on-demand";
+    default:
+        return "off";
+    }
+}
+
+
+static prime_mode_settings prime_mode_from_string(const char *mode)
+{
+    if (strcmp(mode, "on-demand") == 0)
+        return ONDEMAND;
+    else if (strcmp(mode, "on") == 0)
+        return ON;
+    return OFF;
+}
+
+
+#define MAX_QUIRKS 64
+
+typedef enum {
+    DMI_PRODUCT_NAME,
+    DMI_PRODUCT_VERSION,
+} dmi_field;
+
+/* Defaults for specific models. They only apply where the PRIME settings
+ * and the GPU policy say nothing
+ */
+struct quirk {
+    /* The exact DMI string, and where to find it */
+    char match[128];
+    dmi_field field;
+    /* A GPU which must be present. 0 matches any */
+    unsigned int vendor_id;
+    unsigned int device_id;
+    /* A prime_mode_settings, or -1 */
+    int prime_mode;
+    /* 1 to let the GPU suspend, 0 to keep it powered, or -1 */
+    int runtime_pm;
+    /* Don't look for connected outputs through DRM */
+    bool skip_drm;
+    /* From the table below rather than from the quirks file */
+    bool builtin;
+};
+
+/* The models which the Xorg quirks in quirks/ set up nvidia to drive the
+ * screen of. Entries in the quirks file come first.
+ */
+static const struct quirk builtin_quirks[] = {
+    {"Latitude E6530", DMI_PRODUCT_NAME, NVIDIA, 0, ON, -1, false, true},
+    {"ThinkPad T420s", DMI_PRODUCT_VERSION, NVIDIA, 0, ON, -1, false, true},
+};
+
+/* The built-in quirks and those of the quirks file, loaded once and
+ * sorted by match
+ */
+static struct {
+    bool loaded;
+    char *path;
+    int nr_quirks;
+    struct quirk quirks[MAX_QUIRKS];
+} quirks;
+
+static const struct quirk *active_quirk = NULL;
+
+
+static char *strip_spaces(char *str)
+{
+    size_t len;
+
+    while (isspace((unsigned char)*str))
+        str++;
+    len = strlen(str);
+    while (len > 0 && isspace((unsigned char)str[len - 1]))
+        str[--len] = '\0';
+
+    return str;
+}
+
+
+/* Parse "product_name=<DMI string>; gpu=<vendor>[:<device>]; mode=on; pm=on;
+ * drm=skip", or the same with product_version. Only the DMI string is
+ * required.
+ */
+static bool parse_quirk_line(char *line, struct quirk *quirk)
+{
+    char *saveptr = NULL;
+    char *token;
+    char *end;
+    bool has_match = false;
+
+    *quirk = (struct quirk){ .prime_mode = -1, .runtime_pm = -1 };
+
+    for (token = strtok_r(line, ";", &saveptr); token;
+         token = strtok_r(NULL, ";", &saveptr)) {
+        char *value = strchr(token, '=');
+        char *key;
+
+        if (!value)
+            return false;
+        *value++ = '\0';
+        key = strip_spaces(token);
+        value = strip_spaces(value);
+
+        if (strcmp(key, "product_name") == 0 || strcmp(key, "product_version") == 0) {
+            if (has_match || *value == '\0' ||
+                snprintf(quirk->match, sizeof(quirk->match), "%s", value) >= (int)sizeof(quirk->match))
+                return false;
+            quirk->field = strcmp(key, "product_name") == 0 ? DMI_PRODUCT_NAME : DMI_PRODUCT_VERSION;
+            has_match = true;
+        }
+        else if (strcmp(key, "gpu") == 0) {
+            char *device = strchr(value, ':');
+
+            if (device)
+                *device++ = '\0';
+            if (strcasecmp(value, "nvidia") == 0)
+                quirk->vendor_id = NVIDIA;
+            else if (strcasecmp(value, "amd") == 0)
+                quirk->vendor_id = AMD;
+            else if (strcasecmp(value, "intel") == 0)
+                quirk->vendor_id = INTEL;
+            else {
+                quirk->vendor_id = (unsigned int)strtoul(value, &end, 16);
+                if (*end || end == value)
+                    return false;
+            }
+            if (device) {
+                quirk->device_id = (unsigned int)strtoul(device, &end, 16);
+                if (*end || end == device)
+                    return false;
+            }
+        }
+        else if (strcmp(key, "mode") == 0) {
+            if (strcmp(value, "on") != 0 && strcmp(value, "off") != 0 &&
+                strcmp(value, "on-demand") != 0)
+                return false;
+            quirk->prime_mode = prime_mode_from_string(value);
+        }
+        else if (strcmp(key, "pm") == 0) {
+            if (strcmp(value, "auto") == 0)
+                quirk->runtime_pm = 1;
+            else if (strcmp(value, "on") == 0)
+                quirk->runtime_pm = 0;
+            else
+                return false;
+        }
+        else if (strcmp(key, "drm") == 0) {
+            if (strcmp(value, "skip") == 0)
+                quirk->skip_drm = true;
+            else if (strcmp(value, "probe") != 0)
+                return false;
+        }
+        else
+            return false;
+    }
+
+    return has_match;
+}
+
+
+/* By match, and the quirks file first */
+static int compare_quirks(const void *a, const void *b)
+{
+    const struct quirk *quirk_a = a;
+    const struct quirk *quirk_b = b;
+    int ret = strcmp(quirk_a->match, quirk_b->match);
+
+    return ret ? ret : (int)quirk_a->builtin - (int)quirk_b->builtin;
+}
+
+
+/* Load the built-in quirks and those of the quirks file, unless they
+ * were already loaded with the same path
+ */
+static void load_quirks(const char *path)
+{
+    _cleanup_free_ char *line = NULL;
+    _cleanup_fclose_ FILE *file = NULL;
+    size_t len = 0;
+    int nr_line = 0;
+
+    if (quirks.loaded && ((!path && !quirks.path) ||
+                          (path && quirks.path && strcmp(quirks.path, path) == 0)))
+        return;
+
+    free(quirks.path);
+    quirks.path = path ? strdup(path) : NULL;
+    quirks.loaded = true;
+
+    memcpy(quirks.quirks, builtin_quirks, sizeof(builtin_quirks));
+    quirks.nr_quirks = sizeof(builtin_quirks) / sizeof(builtin_quirks[0]);
+
+    file = path ? fopen(path, "r") : NULL;
+
+    while (file && getline(&line, &len, file) != -1) {
+        struct quirk *quirk = &quirks.quirks[quirks.nr_quirks];
+        char *start = strip_spaces(line);
+
+        nr_line++;
+        if (*start == '\0' || *start == '#')
+            continue;
+
+        if (quirks.nr_quirks == MAX_QUIRKS) {
+            log_msg(GPU_MANAGER_LOG_WARNING, "Warning: too many quirks in %s\n", path);
+            break;
+        }
+        if (!parse_quirk_line(start, quirk)) {
+            log_msg(GPU_MANAGER_LOG_ERR, "Error: invalid quirk at %s:%d\n", path, nr_line);
+            continue;
+        }
+        quirks.nr_quirks++;
+    }
+
+    /* Searched with bsearch() */
+    qsort(quirks.quirks, quirks.nr_quirks, sizeof(quirks.quirks[0]), compare_quirks);
+    log_msg(GPU_MANAGER_LOG_DEBUG, "Quirks: %d, with those in %s\n", quirks.nr_quirks,
+            path ? path : "no file");
+}
+
+
+static int compare_quirk(const void *key, const void *elem)
+{
+    return strcmp(key, ((const struct quirk *)elem)->match);
+}
+
+
+static bool has_quirk_gpu(const struct quirk *quirk, const struct gpus *gpus)
+{
+    if (quirk->vendor_id == 0)
+        return true;
+
+    for (int i = 0; i < gpus->nr_cards; i++) {
+        if (gpus->cards[i]->vendor_id == quirk->vendor_id &&
+            (quirk->device_id == 0 || gpus->cards[i]->device_id == quirk->device_id))
+            return true;
+    }
+
+    return false;
+}
+
+
+/* Look up the DMI strings of the system in the quirks, and check the
+ * PCI ids of the entries which match
+ */
+static const struct quirk *find_quirk(const struct gpus *gpus)
+{
+    const char *paths[] = {
+        [DMI_PRODUCT_NAME] = dmi_product_name_path,
+        [DMI_PRODUCT_VERSION] = dmi_product_version_path,
+    };
+    const struct quirk *first = quirks.quirks;
+    const struct quirk *last;
+    char value[128];
+
+    load_quirks(quirks_file);
+    last = first + quirks.nr_quirks;
+
+    for (size_t field = 0; field < sizeof(paths) / sizeof(paths[0]); field++) {
+        const struct quirk *quirk;
+
+        if (!paths[field] || !read_sysfs_attribute(paths[field], value, sizeof(value)))
+            continue;
+        /* DMI strings are often padded with spaces */
+        strip_spaces(value);
+
+        quirk = bsearch(value, first, quirks.nr_quirks, sizeof(*first), compare_quirk);
+        if (!quirk)
+            continue;
+        while (quirk > first && strcmp(quirk[-1].match, value) == 0)
+            quirk--;
+
+        for (; quirk < last && strcmp(quirk->match, value) == 0; quirk++) {
+            if (quirk->field == field && has_quirk_gpu(quirk, gpus)) {
+                log_msg(GPU_MANAGER_LOG_INFO, "Found matching quirk: %s%s\n", quirk->match,
+                        quirk->builtin ? " (built-in)" : "");
+                return quirk;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+/* Get prime action, which can be "on", "off", or "on-demand" */
+static prime_mode_settings get_prime_action(const char *path)
+{
+    char line[100];
+    _cleanup_fclose_ FILE *file = NULL;
+    prime_mode_settings mode = OFF;
+
+    /* Forced from the kernel command line */
+    if (prime_mode_override)
+        return prime_mode_from_string(prime_mode_override);
+    /* The quirk only stands in for a missing setting */
+    if (active_quirk && active_quirk->prime_mode >= 0 && !exists_not_empty(path))
+        return (prime_mode_settings)active_quirk->prime_mode;
+
+    file = fopen(path, "r");
+
+    if (!file) {
+        log_msg(GPU_MANAGER_LOG_ERR, "Error: can't open %s\n", path);
+        return OFF;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        if (istrstr(line, "on-demand") != NULL) {
+            mode = ONDEMAND;
+            break;
+        }
+        else if (istrstr(line, "on") != NULL) {
+            mode = ON;
+            break;
+        }
+        else {
+            mode = OFF;
+            break;
+        }
+    }
+
+    return mode;
+}
+
+#define MAX_GPU_POLICIES 16
+
+typedef enum {
+    POLICY_ANY,
+    POLICY_VENDOR,
+    POLICY_BDF,
+} policy_match;
+
+/* How to treat one GPU, or all the GPUs of a vendor. -1 everywhere
+ * means "follow the other settings"
+ */
+struct gpu_policy {
+    policy_match match;
+    unsigned int vendor_id;
+    unsigned int domain;
+    unsigned int bus;
+    unsigned int dev;
+    unsigned int func;
+    /* A prime_mode_settings */
+    int mode;
+    /* 1 to let the GPU suspend, 0 to keep it powered */
+    int runtime_pm;
+    int autosuspend_delay_ms;
+    /* 1 to leave the module loaded when the mode is "off" */
+    int keep_module;
+};
+
+/* The policy file, read once */
+static struct {
+    char *path;
+    int nr_policies;
+    struct gpu_policy policies[MAX_GPU_POLICIES];
+} gpu_policies;
+
+
+/* Parse "<gpu> key=value..." where <gpu> is a PCI address, a vendor
+ * (nvidia, amd, intel or a hex id) or "*" for all the GPUs
+ */
+static bool parse_policy_line(char *line, struct gpu_policy *policy)
+{
+    char *saveptr = NULL;
+    char *token = strtok_r(line, " \t\n", &saveptr);
+    char *end;
+
+    *policy = (struct gpu_policy){ .mode = -1, .runtime_pm = -1,
+                                   .autosuspend_delay_ms = -1, .keep_module = -1 };
+
+    if (strcmp(token, "*") == 0)
+        policy->match = POLICY_ANY;
+    else if (sscanf(token, "%x:%x:%x.%x", &policy->domain, &policy->bus,
+                    &policy->dev, &policy->func) == 4)
+        policy->match = POLICY_BDF;
+    else {
+        policy->match = POLICY_VENDOR;
+        if (strcasecmp(token, "nvidia") == 0)
+            policy->vendor_id = NVIDIA;
+        else if (strcasecmp(token, "amd") == 0)
+            policy->vendor_id = AMD;
+        else if (strcasecmp(token, "intel") == 0)
+            policy->vendor_id = INTEL;
+        else {
+            policy->vendor_id = (unsigned int)strtoul(token, &end, 16);
+            if (*end || end == token)
+                return false;
+        }
+    }
+
+    while ((token = strtok_r(NULL, " \t\n", &saveptr))) {
+        char *value = strchr(token, '=');
+
+        if (!value)
+            return false;
+        *value++ = '\0';
+
+        if (strcmp(token, "mode") == 0) {
+            if (strcmp(value, "render") == 0)
+                policy->mode = ON;
+            else if (strcmp(value, "offload") == 0)
+                policy->mode = ONDEMAND;
+            else if (strcmp(value, "off") == 0)
+                policy->mode = OFF;
+            else
+                return false;
+        }
+        else if (strcmp(token, "pm") == 0) {
+            if (strcmp(value, "auto") == 0)
+                policy->runtime_pm = 1;
+            else if (strcmp(value, "on") == 0)
+                policy->runtime_pm = 0;
+            else
+                return false;
+        }
+        else if (strcmp(token, "autosuspend-delay-ms") == 0) {
+            policy->autosuspend_delay_ms = (int)strtol(value, &end, 10);
+            if (*end || end == value || policy->autosuspend_delay_ms < 0)
+                return false;
+        }
+        else if (strcmp(token, "keep-module") == 0) {
+            if (strcmp(value, "yes") == 0)
+                policy->keep_module = 1;
+            else if (strcmp(value, "no") == 0)
+                policy->keep_module = 0;
+            else
+                return false;
+        }
+        else
+            return false;
+    }
+
+    return true;
+}
+
+
+/* Read the policy file unless it was already read from the same path */
+static void load_gpu_policies(const char *path)
+{
+    _cleanup_free_ char *line = NULL;
+    _cleanup_fclose_ FILE *file = NULL;
+    size_t len = 0;
+    int nr_line = 0;
+
+    if (!path || (gpu_policies.path && strcmp(gpu_policies.path, path) == 0))
+        return;
+
+    free(gpu_policies.path);
+    gpu_policies.path = strdup(path);
+    gpu_policies.nr_policies = 0;
+
+    file = fopen(path, "r");
+    if (!file)
+        return;
+
+    while (getline(&line, &len, file) != -1) {
+        struct gpu_policy *policy = &gpu_policies.policies[gpu_policies.nr_policies];
+        char *start = line;
+
+        nr_line++;
+        while (isspace((unsigned char)*start))
+            start++;
+        if (*start == '\0' || *start == '#')
+            continue;
+
+        if (gpu_policies.nr_policies == MAX_GPU_POLICIES) {
+            log_msg(GPU_MANAGER_LOG_WARNING, "Warning: too many GPU policies in %s\n", path);
+            break;
+        }
+        if (!parse_policy_line(start, policy)) {
+            log_msg(GPU_MANAGER_LOG_ERR, "Error: invalid GPU policy at %s:%d\n", path, nr_line);
+            continue;
+        }
+        gpu_policies.nr_policies++;
+    }
+
+    log_msg(GPU_MANAGER_LOG_DEBUG, "GPU policies in %s: %d\n", path, gpu_policies.nr_policies);
+}
+
+
+/* The most specific policy for the device: by address, then by vendor,
+ * then for all the GPUs
+ */
+static const struct gpu_policy *find_gpu_policy(const struct device *device)
+{
+    const struct gpu_policy *found = NULL;
+
+    for (int i = 0; i < gpu_policies.nr_policies; i++) {
+        const struct gpu_policy *policy = &gpu_policies.policies[i];
+
+        if (policy->match == POLICY_BDF) {
+            if (policy->domain == device->domain && policy->bus == device->bus &&
+                policy->dev == device->dev && policy->func == device->func)
+                return policy;
+        }
+        else if (policy->match == POLICY_VENDOR) {
+            if (policy->vendor_id == (unsigned int)device->vendor_id &&
+                (!found || found->match == POLICY_ANY))
+                found = policy;
+        }
+        else if (!found) {
+            found = policy;
+        }
+    }
+
+    return found;
+}
+
+
+/* The PRIME mode of a discrete GPU, from its policy if it has one */
+static prime_mode_settings get_device_prime_mode(const char *path, const struct device *device)
+{
+    const struct gpu_policy *policy = find_gpu_policy(device);
+
+    if (!prime_mode_override && policy && policy->mode >= 0)
+        return (prime_mode_settings)policy->mode;
+
+    return get_prime_action(path);
+}
+
+
+static bool keeps_module_loaded(const struct device *device)
+{
+    const struct gpu_policy *policy = find_gpu_policy(device);
+
+    if (policy && policy->keep_module == 1) {
+        log_msg(GPU_MANAGER_LOG_INFO, "Keeping the nvidia modules loaded, as the GPU policy says\n");
+        return true;
+    }
+
+    return false;
+}
+
+
+/* Format the PCI address of the device as used in sysfs */
+static void get_bdf(const struct device *device, char *buf, size_t size)
+{
+    snprintf(buf, size, "%04x:%02x:%02x.%x",
+             device->domain, device->bus, device->dev, device->func);
+}
+
+/* The reverse of get_bdf(), for the fields that it sets */
+static bool get_device_from_bdf(const char *bdf, struct device *device)
+{
+    return sscanf(bdf, "%x:%x:%x.%x", &device->domain, &device->bus,
+                  &device->dev, &device->func) == 4;
+}
+
+static struct device *get_boot_vga(struct gpus *gpus)
+{
+    for (int i = 0; i < gpus->nr_cards; i++) {
+        if (gpus->cards[i]->boot_vga) {
+            return gpus->cards[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Score a discrete GPU by how well it suits render offload: vendor
+ * support first, then link bandwidth, aperture (VRAM) size and whether
+ * it drives any outputs
+ */
+static long score_discrete(const struct device *dev)
+{
+    unsigned long long largest_bar = 0;
+    long score = 0;
+
+    /* Only NVIDIA is supported for PRIME */
+    if (dev->vendor_id == NVIDIA)
+        score += 100000;
+    else if (dev->vendor_id == AMD)
+        score += 50000;
+
+    /* Bandwidth in GT/s times lanes, at most 32 * 16 */
+    score += (long)(dev->max_link_speed / 1000) * dev->max_link_width * 10;
+
+    /* log2 of the largest BAR in MiB, which tracks the VRAM size with
+     * resizable BARs
+     */
+    for (size_t bar = 0; bar < NR_BARS; bar++) {
+        if (dev->bar_size[bar] > largest_bar)
+            largest_bar = dev->bar_size[bar];
+    }
+    for (largest_bar >>= 20; largest_bar > 1; largest_bar >>= 1)
+        score += 100;
+
+    if (dev->has_connected_outputs == 1)
+        score += 10;
+
+    return score;
+}
+
+
+/* Choose the discrete GPU for PRIME and power management: the one pinned
+ * by the admin, if any, or else the one with the highest score. On ties,
+ * the first one in enumeration order wins. If all of them are off by
+ * policy, the first one is chosen, so that PRIME turns it off.
+ */
+static struct device *select_discrete(struct gpus *gpus)
+{
+    struct device *selected = NULL;
+    struct device *off = NULL;
+    long best = -1;
+    char bdf[32];
+
+    for (int i = 0; i < gpus->nr_cards; i++) {
+        struct device *dev = gpus->cards[i];
+
+        const struct gpu_policy *policy;
+
+        if (dev->boot_vga)
+            continue;
+
+        get_bdf(dev, bdf, sizeof(bdf));
+
+        if (discrete_bdf && strcmp(discrete_bdf, bdf) == 0) {
+            log_msg(GPU_MANAGER_LOG_INFO, "Using the pinned discrete GPU %s\n", bdf);
+            return dev;
+        }
+
+        /* GPUs turned off by their policy are only powered down, and
+         * the one picked by address for PRIME wins
+         */
+        policy = find_gpu_policy(dev);
+        if (policy && policy->mode == OFF && policy->match != POLICY_ANY) {
+            log_msg(GPU_MANAGER_LOG_INFO, "Discrete GPU %s is off by policy\n", bdf);
+            if (!off)
+                off = dev;
+            continue;
+        }
+        if (policy && policy->match == POLICY_BDF && policy->mode >= 0 && !discrete_bdf) {
+            log_msg(GPU_MANAGER_LOG_INFO, "Using the discrete GPU %s from the GPU policy\n", bdf);
+            return dev;
+        }
+
+        long score = score_discrete(dev);
+        log_msg(GPU_MANAGER_LOG_DEBUG, "Discrete GPU %s (%04x:%04x) scored %ld\n",
+                bdf, dev->vendor_id, dev->device_id, score);
+        if (score > best) {
+            best = score;
+            selected = dev;
+        }
+    }
+
+    if (discrete_bdf)
+        log_msg(GPU_MANAGER_LOG_WARNING, "Warning: the pinned discrete GPU %s was not found\n", discrete_bdf);
+
+    if (!selected && off) {
+        get_bdf(off, bdf, sizeof(bdf));
+        log_msg(GPU_MANAGER_LOG_INFO, "Only discrete GPUs off by policy, using %s\n", bdf);
+        return off;
+    }
+
+    return selected;
+}
+
+
+static bool has_system_changed(struct gpus *prev, struct gpus *current)
+{
+    if (prev->nr_cards != current->nr_cards) {
+        log_msg(GPU_MANAGER_LOG_INFO, "The number of cards has changed!\n");
+        return true;
+    }
+
+    for (int i = 0; i < prev->nr_cards; i++) {
+        if ((prev->cards[i]->boot_vga != current->cards[i]->boot_vga) ||
+            (prev->cards[i]->vendor_id != current->cards[i]->vendor_id) ||
+            (prev->cards[i]->device_id != current->cards[i]->device_id) ||
+            (prev->cards[i]->domain != current->cards[i]->domain) ||
+            (prev->cards[i]->bus != current->cards[i]->bus) ||
+            (prev->cards[i]->dev != current->cards[i]->dev) ||
+            (prev->cards[i]->func != current->cards[i]->func)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+static bool write_data_to_file(const char *filename, struct gpus *gpus)
+{
+    _cleanup_fclose_ FILE *file = NULL;
+    file = fopen(filename, "w");
+    if (!file) {
+        log_msg(GPU_MANAGER_LOG_ERR, "I couldn't open %s for writing.\n", filename);
+        return false;
+    }
+
+    for (int i = 0; i < gpus->nr_cards; i++) {
+        const struct device *dev = gpus->cards[i];
+
+        fprintf(file, "%04x:%04x;%04x:%02x:%02x:%d;%d",
+                dev->vendor_id,
+                dev->device_id,
+                dev->domain,
+                dev->bus,
+                dev->dev,
+                dev->func,
+                dev->boot_vga);
+        /* Topology */
+        fprintf(file, ";%d;%s;%u/%u;%u/%u;",
+                dev->numa_node,
+                dev->local_cpulist[0] ? dev->local_cpulist : "-",
+                dev->cur_link_speed, dev->cur_link_width,
+                dev->max_link_speed, dev->max_link_width);
+        for (size_t bar = 0; bar < NR_BARS; bar++)
+            fprintf(file, "%s%llx", bar ? "," : "", dev->bar_size[bar]);
+        fprintf(file, ";%x\n", dev->link_health);
+    }
+
+    return true;
+}
+
+
+static struct device *new_device(void)
+{
+    struct device *dev = calloc(1, sizeof(*dev));
+    if (dev) {
+        dev->has_connected_outputs = -1;
+        dev->numa_node = -1;
+    }
+    return dev;
+}
+
+
+/* Parse the optional topology fields which follow the PCI ids */
+static void get_topology_vars(const char *str, struct device *dev)
+{
+    int status;
+
+    status = sscanf(str, ";%d;%63[^;];%u/%u;%u/%u;%llx,%llx,%llx,%llx,%llx,%llx;%x",
+                    &dev->numa_node,
+                    dev->local_cpulist,
+                    &dev->cur_link_speed, &dev->cur_link_width,
+                    &dev->max_link_speed, &dev->max_link_width,
+                    &dev->bar_size[0], &dev->bar_size[1], &dev->bar_size[2],
+                    &dev->bar_size[3], &dev->bar_size[4], &dev->bar_size[5],
+                    &dev->link_health);
+
+    dev->link_health &= LINK_WIDTH_DEGRADED | BRIDGE_WIDTH_DEGRADED;
+
+    if (status >= 2 && strcmp(dev->local_cpulist, "-") == 0)
+        dev->local_cpulist[0] = '\0';
+}
+
+
+static int get_vars(const char *line, struct gpus *gpus, int desired_matches)
+{
+    int status;
+    int consumed = 0;
+
+    struct device *dev = new_device();
+    if (!dev)
+        return -ENOMEM;
+
+    status = sscanf(line, "%04x:%04x;%04x:%02x:%02x:%d;%d%n",
+                    &dev->vendor_id,
+                    &dev->device_id,
+                    &dev->domain,
+                    &dev->bus,
+                    &dev->dev,
+                    &dev->func,
+                    &dev->boot_vga,
+                    &consumed);
+
+    /* Make sure that we match "desired_matches" */
+    if (status == EOF || status != desired_matches) {
+        free(dev);
+        dev = NULL;
+    }
+    else {
+        get_topology_vars(line + consumed, dev);
+    }
+
+    gpus->cards[gpus->nr_cards] = dev;
+    return status;
+}
+
+
+/* Return 0 if it failed, 1 if it succeeded,
+ * 2 if it created the file for the first time
+ */
+static int read_data_from_file(const char *filename, struct gpus *gpus)
+{
+    char line[512];
+    _cleanup_fclose_ FILE *file = NULL;
+    /* The number of digits we expect to match per line */
+    int desired_matches = 7;
+    int created = 1;
+
+    file = fopen(filename, "r");
+    if (file == NULL) {
+        created = 2;
+        log_msg(GPU_MANAGER_LOG_WARNING, "I couldn't open %s for reading.\n", filename);
+        /* Create the file for the 1st time */
+        file = fopen(filename, "w");
+        log_msg(GPU_MANAGER_LOG_INFO, "Create %s for the 1st time\n", filename);
+        if (file == NULL) {
+            log_msg(GPU_MANAGER_LOG_ERR, "I couldn't open %s for writing.\n",
+                    filename);
+            return 0;
+        }
+        fprintf(file, "%04x:%04x;%04x:%02x:%02x:%d;%d\n",
+                0, 0, 0, 0, 0, 0, 0);
+        fflush(file);
+        fclose(file);
+        /* Try again */
+        file = fopen(filename, "r");
+    }
+
+    if (file == NULL) {
+        log_msg(GPU_MANAGER_LOG_ERR, "I couldn't open %s for reading.\n", filename);
+        return 0;
+    }
+    else {
+        /* Use fgets so as to limit the buffer length */
+        while (fgets(line, sizeof(line), file) && (gpus->nr_cards < MAX_NR_CARDS)) {
+            if (strlen(line) > 0) {
+                /* See if we actually get all the desired digits,
+                 * as per "desired_matches"
+                 */
+                if (get_vars(line, gpus, desired_matches) == desired_matches) {
+                    gpus->nr_cards += 1;
+                }
+            }
+        }
+    }
+
+    return created;
+}
+
+
+static const char *action_names[] = {
+    [ACTION_NONE] = "none",
+    [ACTION_PRIME] = "prime",
+    [ACTION_AMDGPU_PRO_POWERSAVING] = "amdgpu-pro-powersaving",
+    [ACTION_AMDGPU_PRO_RESET] = "amdgpu-pro-reset",
+    [ACTION_REMOVE_OFFLOAD] = "remove-offload",
+};
+
+
+static bool write_decision_to_file(const char *filename, const struct decision *decision)
+{
+    _cleanup_fclose_ FILE *file = NULL;
+    file = fopen(filename, "w");
+    if (!file) {
+        log_msg(GPU_MANAGER_LOG_ERR, "I couldn't open %s for writing.\n", filename);
+        return false;
+    }
+
+    fprintf(file, "timestamp=%lld\n", (long long)decision->timestamp);
+    fprintf(file, "action=%s\n", action_names[decision->action]);
+    fprintf(file, "prime_mode=%s\n", prime_mode_to_string(decision->prime_mode));
+    fprintf(file, "offloading=%d\n", decision->offloading);
+    fprintf(file, "discrete=%s\n", decision->discrete);
+    fflush(file);
+
+    return true;
+}
+
+
+/* Read the decision taken in the last run. Return false if there is none */
+static bool read_decision_from_file(const char *filename, struct decision *decision)
+{
+    char line[100];
+    char value[64];
+    long long timestamp;
+    _cleanup_fclose_ FILE *file = NULL;
+
+    memset(decision, 0, sizeof(*decision));
+    decision->prime_mode = OFF;
+
+    file = fopen(filename, "r");
+    if (file == NULL)
+        return false;
+
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "timestamp=%lld", &timestamp) == 1) {
+            decision->timestamp = (time_t)timestamp;
+        }
+        else if (sscanf(line, "action=%63s", value) == 1) {
+            for (size_t i = 0; i < sizeof(action_names) / sizeof(action_names[0]); i++) {
+                if (strcmp(value, action_names[i]) == 0)
+                    decision->action = i;
+            }
+        }
+        else if (sscanf(line, "prime_mode=%63s", value) == 1) {
+            decision->prime_mode = prime_mode_from_string(value);
+        }
+        else if (sscanf(line, "offloading=%d", &decision->offloading) == 1) {
+            continue;
+        }
+        else if (sscanf(line, "discrete=%31s", decision->discrete) == 1) {
+            continue;
+        }
+    }
+
+    return decision->timestamp != 0;
+}
+
+
+static void add_gpu_from_file(char *filename, char *dirname, struct gpus *gpus)
+{
+    int status = EOF;
+    char path[PATH_MAX];
+    char pattern[] = "u-d-c-gpu-%04x:%02x:%02x.%d-0x%04x-0x%04x";
+
+    log_msg(GPU_MANAGER_LOG_INFO, "Adding GPU from file: %s\n", filename);
+
+    /* The number of digits we expect to match in the name */
+    int desired_matches = 6;
+
+    struct device *dev = new_device();
+    if (!dev)
+        return;
+
+    /* The name pattern will look like the following:
+     * u-d-c-gpu-0000:09:00.0-0x10de-0x1140
+     */
+    sprintf(path, "%s/%s", dirname, pattern);
+
+    /* Extract the data from the string */
+    status = sscanf(filename, path,
+                    &dev->domain,
+                    &dev->bus,
+                    &dev->dev,
+                    &dev->func,
+                    &dev->vendor_id,
+                    &dev->device_id);
+
+    /* Check that we actually matched all the desired digits,
+     * as per "desired_matches"
+     */
+    if (status == EOF || status != desired_matches) {
+        free(dev);
+        log_msg(GPU_MANAGER_LOG_DEBUG, "no matches, status = %d, expected = %d\n", status, desired_matches);
+        return;
+    }
+
+    dev->has_connected_outputs = -1;
+
+    log_msg(GPU_MANAGER_LOG_DEBUG, "Adding %04x:%04x in PCI:%02x@%04x:%02x:%d to the list\n",
+            dev->vendor_id, dev->device_id,
+            dev->bus, dev->domain,
+            dev->dev, dev->func);
+
+    gpus->cards[gpus->nr_cards] = dev;
+    gpus->nr_cards += 1;
+
+    log_msg(GPU_MANAGER_LOG_INFO, "Successfully detected disabled cards. Total number is %d now\n", gpus->nr_cards);
+}
+
+
+/* Look for clues of disabled cards in the directory */
+static void find_disabled_cards(char *dir, struct gpus *gpus,
+                                void (*fcn)(char *, char *, struct gpus *))
+{
+    char name[PATH_MAX];
+    struct dirent *dp;
+    DIR *dfd;
+
+    log_msg(GPU_MANAGER_LOG_DEBUG, "Looking for disabled cards in %s\n", dir);
+
+    if ((dfd = opendir(dir)) == NULL) {
+        fprintf(stderr, "Error: can't open %s\n", dir);
+        return;
+    }
+
+    while ((dp = readdir(dfd)) != NULL) {
+        if (!starts_with(dp->d_name, "u-d-c-gpu-"))
+            continue;
+        if (strlen(dir)+strlen(dp->d_name)+2 > sizeof(name))
+            fprintf(stderr, "Error: name %s/%s too long\n",
+                    dir, dp->d_name);
+        else {
+            sprintf(name, "%s/%s", dir, dp->d_name);
+            (*fcn)(name, dir, gpus);
+        }
+    }
+    closedir(dfd);
+}
+
+
+/* Check if a kernel module is available for the current kernel */
+static bool is_module_available(const char *module)
+{
+    char dir[PATH_MAX];
+    struct dirent *dp;
+    DIR *dfd;
+    struct utsname uname_data;
+    bool status = false;
+
+    if (uname(&uname_data) < 0) {
+        fprintf(stderr, "Error: uname failed\n");
+        return false;
+    }
+
+    sprintf(dir, "/lib/modules/%s/updates/dkms", uname_data.release);
+
+    log_msg(GPU_MANAGER_LOG_DEBUG, "Looking for %s modules in %s\n", module, dir);
+
+    if ((dfd = opendir(dir)) == NULL) {
+        fprintf(stderr, "Error: can't open %s\n", dir);
+        return false;
+    }
+
+    while ((dp = readdir(dfd)) != NULL) {
+        if (!starts_with(dp->d_name, module))
+            continue;
+
+        status = true;
+        log_msg(GPU_MANAGER_LOG_DEBUG, "Found %s module: %s\n", module, dp->d_name);
+        break;
+    }
+    closedir(dfd);
+
+    return status;
+}
+
+
+static bool is_link(char *file)
+{
+    struct stat stbuf;
+
+    if (lstat(file, &stbuf) == -1) {
+        log_msg(GPU_MANAGER_LOG_ERR, "Error: can't access %s\n", file);
+        return false;
+    }
+    if ((stbuf.st_mode & S_IFMT) == S_IFLNK)
+        return true;
+
+    return false;
+}
+
+
+/* Get the name of the driver a device is bound to from
+ * its sysfs "driver" link
+ */
+static bool get_sysfs_driver_name(const char *link, char *buf, size_t size) {
+    char target[PATH_MAX];
+    char *name;
+    ssize_t length;
+
+    length = readlink(link, target, sizeof(target) - 1);
+    if (length == -1)
+        return false;
+    target[length] = '\0';
+
+    name = strrchr(target, '/');
+    name = name ? name + 1 : target;
+
+    /* A truncated name would match the wrong driver */
+    return snprintf(buf, size, "%s", name) < (int)size;
+}
+
+
+/* See if the device is bound to a driver */
+static bool is_device_bound_to_driver(const struct device *device) {
+    char sysfs_path[1024];
+    snprintf(sysfs_path, sizeof(sysfs_path),
+             "/sys/bus/pci/devices/%04x:%02x:%02x.%d/driver",
+             device->domain, device->bus, device->dev, device->func);
+
+    return(is_link(sysfs_path));
+}
+
+
+/* See if the PCI function at "bdf" is assigned, or can be assigned, to
+ * virtual machines. If it is, write the reason why to "reason" and
+ * return true.
+ */
+static bool get_pci_passthrough_reason(const char *bdf, bool boot_vga,
+                                       char *reason, size_t size) {
+    static const char *passthrough_drivers[] = {
+        "pci-stub", "pciback", "vfio-pci",
+    };
+    char sysfs_path[PATH_MAX], name[48];
+    struct stat stbuf;
+
+    snprintf(sysfs_path, sizeof(sysfs_path), "/sys/bus/pci/devices/%s/driver", bdf);
+    if (get_sysfs_driver_name(sysfs_path, name, sizeof(name))) {
+        for (size_t i = 0; i < sizeof(passthrough_drivers) / sizeof(passthrough_drivers[0]); i++) {
+            if (strcmp(name, passthrough_drivers[i]) == 0) {
+                snprintf(reason, size, "bound to %s", name);
+                return true;
+            }
+        }
+    }
+
+    /* SR-IOV virtual functions link to their physical function */
+    snprintf(sysfs_path, sizeof(sysfs_path), "/sys/bus/pci/devices/%s/physfn", bdf);
+    if (lstat(sysfs_path, &stbuf) == 0) {
+        snprintf(reason, size, "SR-IOV virtual function");
+        return true;
+    }
+
+    /* Parents of mediated devices. If it's the boot VGA, the host is
+     * using it too (e.g. Intel GVT-g), so we can't leave it alone.
+     */
+    snprintf(sysfs_path, sizeof(sysfs_path), "/sys/bus/pci/devices/%s/mdev_supported_types", bdf);
+    if (!boot_vga && stat(sysfs_path, &stbuf) == 0) {
+        snprintf(reason, size, "mediated device parent");
+        return true;
+    }
+
+    return false;
+}
+
+
+/* See if the device is a pci passthrough */
+static bool get_device_passthrough_reason(const struct device *device,
+                                          char *reason, size_t size) {
+    char bdf[32];
+
+    get_bdf(device, bdf, sizeof(bdf));
+
+    return get_pci_passthrough_reason(bdf, device->boot_vga, reason, size);
+}
+
+
+/* Check the drm connector status */
+static bool is_connector_connected(const char *connector) {
+    bool status = false;
+    char line[50];
+    _cleanup_fclose_ FILE *file = NULL;
+
+    file = fopen(connector, "r");
+
+    if (!file)
+        return false;
+
+    while (fgets(line, sizeof(line), file)) {
+        char *tok;
+        tok = strtok(line, " \t");
+        if (starts_with(tok, "connected")) {
+            status = true;
+            break;
+        }
+    }
+
+    return status;
+}
+
+
+/* Count the number of outputs connected to the card */
+static int count_connected_outputs(const char *device_name) {
+    char name[PATH_MAX];
+    struct dirent *dp;
+    DIR *dfd;
+    int connected_outputs = 0;
+    char drm_dir[] = "/sys/class/drm";
+
+    if ((dfd = opendir(drm_dir)) == NULL) {
+        fprintf(stderr, "Warning: can't open %s\n", drm_dir);
+        return connected_outputs;
+    }
+
+    while ((dp = readdir(dfd)) != NULL) {
+        if (!starts_with(dp->d_name, device_name))
+            continue;
+        if (strlen(drm_dir)+strlen(dp->d_name)+2 > sizeof(name))
+            fprintf(stderr, "Warning: name %s/%s too long\n",
+                    drm_dir, dp->d_name);
+        else {
+            /* Open the file for the connector */
+            snprintf(name, sizeof(name), "%s/%s/status", drm_dir, dp->d_name);
+            name[sizeof(name) - 1] = 0;
+            if (is_connector_connected(name)) {
+                log_msg(GPU_MANAGER_LOG_DEBUG, "output %d:\n", connected_outputs);
+                log_msg(GPU_MANAGER_LOG_DEBUG, "\t%s\n", dp->d_name);
+                connected_outputs++;
+            }
+        }
+    }
+    closedir(dfd);
+
+    return connected_outputs;
+}
+
+
+/* See if a drm card is runtime suspended (or on its way there).
+ * Opening the device node would wake it up.
+ */
+static bool is_card_runtime_suspended(const char *card, char *status, size_t size) {
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "/sys/class/drm/%s/device/power/runtime_status",
+             card);
+
+    if (!read_sysfs_attribute(path, status, size))
+        return false;
+
+    return starts_with(status, "suspend");
+}
+
+
+/* Get the name of the driver from the drm device node */
+static bool get_drm_driver_name(const char *path, char *buf, size_t size) {
+    int fd;
+    drmVersionPtr version;
+
+    if (!load_drm())
+        return false;
+
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    version = drm_api.get_version(fd);
+    close(fd);
+
+    if (!version)
+        return false;
+
+    snprintf(buf, size, "%s", version->name);
+    drm_api.free_version(version);
+
+    return true;
+}
+
+
+/* Find out which driver each drm card is driven by, and how many outputs
+ * are connected to it.
+ *
+ * In no-wake mode, cards which are runtime suspended are not opened, as
+ * that would resume them. The driver comes from the sysfs "driver" link
+ * instead, and the connector status in sysfs only reports the state from
+ * the last probe, without triggering a new one.
+ */
+static void probe_drm_cards(struct drm_cards *drm) {
+    DIR *dir;
+    struct dirent* dir_entry;
+    char path[PATH_MAX];
+    char boot_vga_path[PATH_MAX];
+    char bdf[64];
+    char status[32];
+    char reason[64];
+    bool boot_vga;
+    char dri_dir[] = "/dev/dri";
+
+    if (NULL == (dir = opendir(dri_dir))) {
+        log_msg(GPU_MANAGER_LOG_ERR, "Error : Failed to open %s\n", dri_dir);
+        return;
+    }
+
+    while ((dir_entry = readdir(dir))) {
+        if (!starts_with(dir_entry->d_name, "card"))
+            continue;
+
+        if (drm->nr_cards >= MAX_NR_DRM_CARDS) {
+            log_msg(GPU_MANAGER_LOG_WARNING, "Warning: too many drm cards. "
+                                "Max supported %d. Ignoring the rest.\n",
+                                MAX_NR_DRM_CARDS);
+            break;
+        }
+
+        struct drm_card *card = &drm->cards[drm->nr_cards];
+        snprintf(card->name, sizeof(card->name), "%s", dir_entry->d_name);
+
+        /* Don't touch the devices which belong to virtual machines */
+        snprintf(path, sizeof(path), "/sys/class/drm/%s/device", card->name);
+        if (get_sysfs_driver_name(path, bdf, sizeof(bdf))) {
+            snprintf(boot_vga_path, sizeof(boot_vga_path), "/sys/bus/pci/devices/%s/boot_vga", bdf);
+            boot_vga = read_sysfs_attribute(boot_vga_path, status, sizeof(status)) &&
+                       strcmp(status, "1") == 0;
+            if (get_pci_passthrough_reason(bdf, boot_vga, reason, sizeof(reason))) {
+                log_msg(GPU_MANAGER_LOG_INFO, "Skipping \"%s/%s\": %s is a pci passthrough (%s)\n",
+                        dri_dir, card->name, bdf, reason);
+                continue;
+            }
+        }
+
+        if (no_wake && is_card_runtime_suspended(card->name, status, sizeof(status))) {
+            snprintf(path, sizeof(path), "/sys/class/drm/%s/device/driver", card->name);
+            if (!get_sysfs_driver_name(path, card->driver, sizeof(card->driver))) {
+                log_msg(GPU_MANAGER_LOG_ERR, "Error: can't get the driver of %s from %s\n",
+                        card->name, path);
+                continue;
+            }
+            log_msg(GPU_MANAGER_LOG_INFO, "Not waking \"%s/%s\" (runtime status: %s), driven by \"%s\"\n",
+                    dri_dir, card->name, status, card->driver);
+        }
+        else {
+            snprintf(path, sizeof(path), "%s/%s", dri_dir, card->name);
+            if (!get_drm_driver_name(path, card->driver, sizeof(card->driver))) {
+                log_msg(GPU_MANAGER_LOG_ERR, "Error: can't open fd for %s\n", path);
+                continue;
+            }
+        }
+
+        card->connected_outputs = count_connected_outputs(card->name);
+        drm->nr_cards += 1;
+    }
+
+    closedir(dir);
+}
+
+
+/* See if the drm device created by a driver has any connected outputs.
+ * Return 1 if outputs are connected, 0 if they're not, -1 if unknown
+ */
+static int has_driver_connected_outputs(const struct drm_cards *drm, const char *driver) {
+    for (int i = 0; i < drm->nr_cards; i++) {
+        const struct drm_card *card = &drm->cards[i];
+
+        /* Let's use strstr to catch the different backported
+         * kernel modules
+         */
+        if (strstr(card->driver, driver) != NULL) {
+            log_msg(GPU_MANAGER_LOG_DEBUG, "Found \"/dev/dri/%s\", driven by \"%s\"\n",
+                    card->name, card->driver);
+            log_msg(GPU_MANAGER_LOG_DEBUG, "Number of connected outputs for /dev/dri/%s: %d\n",
+                    card->name, card->connected_outputs);
+            return (card->connected_outputs > 0);
+        }
+    }
+
+    return -1;
+}
+
+
+/* Check if any outputs are still connected to card0.
+ *
+ * By default we only check cards driven by i915 or by amdgpu (APUs).
+ * If so, then claim support for RandR offloading. An AMD boot VGA is
+ * often the only GPU of a desktop, so it only counts next to a discrete
+ * GPU, or if nvidia was unloaded and its GPU is gone.
+ */
+static bool requires_offloading(struct gpus *gpus, bool nvidia_unloaded)
+{
+    /* Let's check only the boot VGA and look
+     * for Intel or AMD. We don't want to enable
+     * offloading to any other driver, as results
+     * may be unpredictable
+     */
+    const struct device *dev = get_boot_vga(gpus);
+
+    if (!dev || dev->has_connected_outputs != 1)
+        return false;
+    if (dev->vendor_id == INTEL)
+        return true;
+    if (dev->vendor_id != AMD)
+        return false;
+
+    for (int i = 0; i < gpus->nr_cards; i++) {
+        if (!gpus->cards[i]->boot_vga)
+            return true;
+    }
+
+    return nvidia_unloaded;
+}
+
+
+/* Set permanent settings for offloading */
+static bool set_offloading(void) {
+    _cleanup_fclose_ FILE *file = NULL;
+
+    if (dry_run)
+        return true;
+
+    file = fopen(OFFLOADING_CONF, "w");
+    if (file != NULL) {
+        fprintf(file, "ON\n");
+        fflush(file);
+        return true;
+    }
+
+    return false;
+}
+
+
+static bool create_prime_settings(const char *path) {
+    _cleanup_fclose_ FILE *file = NULL;
+
+    log_msg(GPU_MANAGER_LOG_INFO, "Trying to create new settings for prime. Path: %s\n", path);
+
+    file = fopen(path, "w");
+    if (file == NULL) {
+        log_msg(GPU_MANAGER_LOG_ERR, "I couldn't open %s for writing.\n", path);
+        return false;
+    }
+    /* Set prime to "on", unless the model has a default of its own */
+    if (active_quirk && active_quirk->prime_mode >= 0)
+        fprintf(file, "%s\n", prime_mode_to_string((prime_mode_settings)active_quirk->prime_mode));
+    else
+        fprintf(file, "on\n");
+    fflush(file);
+
+    return true;
+}
+
+
+static char* get_module_version(const char *module_name) {
+    struct kmod_ctx *ctx = NULL;
+    struct kmod_module *mod = NULL;
+    struct kmod_list *l, *list = NULL;
+    int err;
+    char *version = NULL;
+
+    if (!load_kmod())
+        return NULL;
+
+    ctx = kmod_api.new(NULL, NULL);
+    if (!ctx)
+        return NULL;
+
+    err = kmod_api.module_new_from_name(ctx, module_name, &mod);
+    if (err < 0) {
+        log_msg(GPU_MANAGER_LOG_WARNING, "can't acquire module via kmod\n");
+        goto get_module_version_clean;
+    }
+
+    err = kmod_api.module_get_info(mod, &list);
+    if (err < 0) {
+        log_msg(GPU_MANAGER_LOG_WARNING, "can't get module info via kmod\n");
+        goto get_module_version_clean;
+    }
+
+    /* kmod_list_foreach(), through the loaded kmod_list_next() */
+    for (l = list; l != NULL; l = kmod_api.list_next(list, l)) {
+        const char *key = kmod_api.module_info_get_key(l);
+
+        if (strcmp(key, "version") == 0) {
+            version = strdup(kmod_api.module_info_get_value(l));
+            break;
+        }
+    }
+
+get_module_version_clean:
+    if (list)
+        kmod_api.module_info_free_list(list);
+    if (mod)
+        kmod_api.module_unref(mod);
+    if (ctx)
+        kmod_api.unref(ctx);
+
+    return version;
+}
+
+
+static bool is_module_versioned(const char *module_name) {
+    _cleanup_free_ const char *version = NULL;
+
+    if (dry_run)
+        return false;
+
+    version = get_module_version(module_name);
+
+    return version ? true : false;
+}
+
+
+static bool run_amdgpu_pro_px(amdgpu_pro_px_action action) {
+    char *argv[4] = { amdgpu_pro_px_file, NULL, NULL, NULL };
+
+    switch (action) {
+    case MODE_POWERSAVING:
+        argv[1] = "--mode";
+        argv[2] = "powersaving";
+        log_msg(GPU_MANAGER_LOG_INFO, "Enabling power saving mode for amdgpu-pro\n");
+        break;
+    case MODE_PERFORMANCE:
+        argv[1] = "--mode";
+        argv[2] = "performance";
+        log_msg(GPU_MANAGER_LOG_INFO, "Enabling performance mode for amdgpu-pro\n");
+        break;
+    case RESET:
+        argv[1] = "--reset";
+        log_msg(GPU_MANAGER_LOG_INFO, "Resetting the script changes for amdgpu-pro\n");
+        break;
+    case ISPX:
+        argv[1] = "--ispx";
+        break;
+    }
+
+    if (dry_run) {
+        log_msg(GPU_MANAGER_LOG_INFO, "%s %s%s%s\n", argv[0], argv[1],
+                argv[2] ? " " : "", argv[2] ? argv[2] : "");
+        return true;
+    }
+
+    return run_command(argv, AMDGPU_PRO_PX_TIMEOUT_MS, NULL) == 0;
+}
+
+
+static bool create_prime_outputclass(void) {
+    _cleanup_fclose_ FILE *file = NULL;
+    _cleanup_free_ char *multiarch = NULL;
+    char *argv[] = { "/usr/bin/dpkg-architecture", "-qDEB_HOST_MULTIARCH", NULL };
+    char xorg_d_custom[PATH_MAX];
+
+    snprintf(xorg_d_custom, sizeof(xorg_d_custom), "%s/11-nvidia-prime.conf",
+             xorg_conf_d_path);
+
+    multiarch = get_output(argv, NULL, NULL);
+    if (!multiarch)
+        return false;
+
+    log_msg(GPU_MANAGER_LOG_INFO, "Creating %s\n", xorg_d_custom);
+    file = fopen(xorg_d_custom, "w");
+    if (!file) {
+        log_msg(GPU_MANAGER_LOG_ERR, "Error while creating %s\n", xorg_d_custom);
+    }
+    else {
+        fprintf(file,
+                "# DO NOT EDIT. AUTOMATICALLY GENERATED BY gpu-manager\n\n"
+                "Section \"OutputClass\"\n"
+                "    Identifier \"Nvidia Prime\"\n"
+                "    MatchDriver \"nvidia-drm\"\n"
+                "    Driver \"nvidia\"\n"
+                "    Option \"AllowEmptyInitialConfiguration\"\n"
+                "    Option \"IgnoreDisplayDevices\" \"CRT\"\n"
+                "    Option \"PrimaryGPU\" \"Yes\"\n"
+                "    ModulePath \"/%s/nvidia/xorg\"\n"
+                "EndSection\n\n",
+                multiarch);
+
+        fflush(file);
+        return true;
+    }
+
+    return false;
+}
+
+static bool create_offload_serverlayout(void) {
+    _cleanup_fclose_ FILE *file = NULL;
+    char xorg_d_custom[PATH_MAX];
+
+    snprintf(xorg_d_custom, sizeof(xorg_d_custom), "%s/11-nvidia-offload.conf",
+             xorg_conf_d_path);
+
+    log_msg(GPU_MANAGER_LOG_INFO, "Creating %s\n", xorg_d_custom);
+    file = fopen(xorg_d_custom, "w");
+    if (!file) {
+        log_msg(GPU_MANAGER_LOG_ERR, "Error while creating %s\n", xorg_d_custom);
+    }
+    else {
+        fprintf(file,
+                "# DO NOT EDIT. AUTOMATICALLY GENERATED BY gpu-manager\n\n"
+                "Section \"ServerLayout\"\n"
+                "    Identifier \"layout\"\n"
+                "    Option \"AllowNVIDIAGPUScreens\"\n"
+                "EndSection\n\n");
+
+        fflush(file);
+        return true;
+    }
+
+    return false;
+}
+
+/* Attempt to remove a file named "name" in xorg_conf_d_path. Returns 0 if the
+ * file is successfully removed, or -errno on failure. */
+static int remove_xorg_d_custom_file(const char *name) {
+    char path[PATH_MAX];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/%s", xorg_conf_d_path, name);
+    if (stat(path, &st) == 0) {
+        log_msg(GPU_MANAGER_LOG_INFO, "Removing %s\n", path);
+        if (unlink(path) == 0) {
+            return 0;
+        }
+    }
+
+    return -errno;
+}
+
+static int remove_prime_outputclass(void) {
+    return remove_xorg_d_custom_file("11-nvidia-prime.conf");
+}
+
+static bool has_xorg_d_custom_file(const char *name) {
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%s", xorg_conf_d_path, name);
+    return access(path, F_OK) == 0;
+}
+
+static int remove_offload_serverlayout(void) {
+    return remove_xorg_d_custom_file("11-nvidia-offload.conf");
+}
+
+static bool write_sysfs_attribute(const char *path, const char *value) {
+    _cleanup_fclose_ FILE *file = NULL;
+
+    file = fopen(path, "w");
+    if (!file) {
+        log_msg(GPU_MANAGER_LOG_ERR, "Error while opening %s\n", path);
+        return false;
+    }
+
+    fprintf(file, "%s\n", value);
+    fflush(file);
+
+    return !ferror(file);
+}
+
+
+/* Apply the runtime power management policy to a single PCI function */
+static bool set_runtime_pm(const char *bdf, bool enabled, int delay_ms) {
+    char path[PATH_MAX];
+    char delay[16];
+    bool status;
+
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/power/control", bdf);
+    log_msg(GPU_MANAGER_LOG_INFO, "Setting power control to \"%s\" in %s\n", enabled ? "auto" : "on", path);
+    status = write_sysfs_attribute(path, enabled ? "auto" : "on");
+
+    if (enabled && delay_ms >= 0) {
+        snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/power/autosuspend_delay_ms", bdf);
+        snprintf(delay, sizeof(delay), "%d", delay_ms);
+        log_msg(GPU_MANAGER_LOG_INFO, "Setting autosuspend delay to %s ms in %s\n", delay, path);
+        write_sysfs_attribute(path, delay);
+    }
+
+    return status;
+}
+
+
+/* Apply the policy to the other functions in the slot of the GPU, such
+ * as the HDMI audio and the USB-C/UCSI controllers. As long as any of
+ * them is kept active, the GPU can't be suspended.
+ */
+static void set_runtime_pm_siblings(const struct device *device, bool enabled, int delay_ms) {
+    char prefix[32];
+    char bdf[32];
+    char reason[64];
+    struct dirent *dp;
+    DIR *dfd;
+    char pci_dir[] = "/sys/bus/pci/devices";
+
+    snprintf(prefix, sizeof(prefix), "%04x:%02x:%02x.",
+             device->domain, device->bus, device->dev);
+    get_bdf(device, bdf, sizeof(bdf));
+
+    if ((dfd = opendir(pci_dir)) == NULL) {
+        log_msg(GPU_MANAGER_LOG_ERR, "Error: can't open %s\n", pci_dir);
+        return;
+    }
+
+    while ((dp = readdir(dfd)) != NULL) {
+        if (!starts_with(dp->d_name, prefix) || strcmp(dp->d_name, bdf) == 0)
+            continue;
+
+        if (get_pci_passthrough_reason(dp->d_name, false, reason, sizeof(reason))) {
+            log_msg(GPU_MANAGER_LOG_INFO, "Skipping sibling function %s: pci passthrough (%s)\n",
+                    dp->d_name, reason);
+            continue;
+        }
+
+        log_msg(GPU_MANAGER_LOG_INFO, "Applying the power policy to sibling function %s\n", dp->d_name);
+        set_runtime_pm(dp->d_name, enabled, delay_ms);
+    }
+    closedir(dfd);
+}
+
+
+static bool manage_power_management(const struct device *device, bool enabled) {
+    const struct gpu_policy *policy = find_gpu_policy(device);
+    int delay_ms = autosuspend_delay_ms;
+    char bdf[32];
+
+    get_bdf(device, bdf, sizeof(bdf));
+
+    if (policy && policy->runtime_pm >= 0) {
+        if (enabled != (policy->runtime_pm == 1))
+            log_msg(GPU_MANAGER_LOG_INFO, "Runtime power management %s by the GPU policy\n",
+                    policy->runtime_pm ? "enabled" : "disabled");
+        enabled = policy->runtime_pm == 1;
+    }
+    else if (active_quirk && active_quirk->runtime_pm >= 0) {
+        if (enabled != (active_quirk->runtime_pm == 1))
+            log_msg(GPU_MANAGER_LOG_INFO, "Runtime power management %s by quirk\n",
+                    active_quirk->runtime_pm ? "enabled" : "disabled");
+        enabled = active_quirk->runtime_pm == 1;
+    }
+
+    if (policy && policy->autosuspend_delay_ms >= 0)
+        delay_ms = policy->autosuspend_delay_ms;
+
+    if (pm_siblings)
+        set_runtime_pm_siblings(device, enabled, delay_ms);
+
+    return set_runtime_pm(bdf, enabled, delay_ms);
+}
+
+static void enable_power_management(const struct device *device) {
+    manage_power_management(device, true);
+}
+
+
+/* Poll runtime_status until the device reaches the state expected by the
+ * policy, or until the timeout expires. When the device should be
+ * suspended, also report whether it made it to D3cold.
+ */
+static bool verify_power_management(const struct device *device, bool enabled) {
+    char path[PATH_MAX];
+    char bdf[32];
+    char status[32] = "unknown";
+    char power_state[32] = "unknown";
+    const char *expected = enabled ? "suspended" : "active";
+    const int interval_ms = 50;
+    int waited_ms = 0;
+    bool reached = false;
+
+    if (dry_run || pm_verify_timeout_ms < 0)
+        return true;
+
+    get_bdf(device, bdf, sizeof(bdf));
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/power/runtime_status", bdf);
+
+    while (true) {
+        if (!read_sysfs_attribute(path, status, sizeof(status))) {
+            log_msg(GPU_MANAGER_LOG_ERR, "Error: can't read %s\n", path);
+            return false;
+        }
+        if (strcmp(status, expected) == 0) {
+            reached = true;
+            break;
+        }
+        if (waited_ms >= pm_verify_timeout_ms)
+            break;
+        usleep(interval_ms * 1000);
+        waited_ms += interval_ms;
+    }
+
+    log_msg(GPU_MANAGER_LOG_INFO, "Runtime status of %s: %s after %d ms (expected %s)\n",
+            bdf, status, waited_ms, expected);
+
+    if (enabled) {
+        /* power_state is only available on recent kernels */
+        snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/power_state", bdf);
+        read_sysfs_attribute(path, power_state, sizeof(power_state));
+        log_msg(GPU_MANAGER_LOG_INFO, "Was D3cold reached? %s (power state: %s)\n",
+                strcmp(power_state, "D3cold") == 0 ? "yes" : "no", power_state);
+    }
+
+    return reached;
+}
+
+/* Read a numeric runtime PM attribute of a PCI device */
+static bool read_runtime_pm_value(const char *bdf, const char *attribute, long long *value)
+{
+    char path[PATH_MAX];
+    char buf[32];
+
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/power/%s", bdf, attribute);
+    if (!read_sysfs_attribute(path, buf, sizeof(buf)))
+        return false;
+
+    return sscanf(buf, "%lld", value) == 1;
+}
+
+
+/* Write the runtime PM residency of the GPUs, and the last decision, in
+ * the Prometheus text exposition format
+ */
+static void write_metrics(FILE *file, struct gpus *gpus, const struct decision *decision)
+{
+    static const char *runtime_states[] = {
+        "active", "suspended", "suspending", "resuming", "error", "unsupported",
+    };
+    static const struct {
+        const char *attribute;
+        const char *name;
+        const char *help;
+    } residency[] = {
+        { "runtime_active_time", "gpu_manager_runtime_active_seconds_total",
+          "Time the GPU spent runtime active." },
+        { "runtime_suspended_time", "gpu_manager_runtime_suspended_seconds_total",
+          "Time the GPU spent runtime suspended." },
+    };
+    char bdf[32];
+    char labels[128];
+    char path[PATH_MAX];
+    char status[32];
+    long long value;
+
+    for (size_t r = 0; r < sizeof(residency) / sizeof(residency[0]); r++) {
+        fprintf(file, "# HELP %s %s\n", residency[r].name, residency[r].help);
+        fprintf(file, "# TYPE %s counter\n", residency[r].name);
+        for (int i = 0; i < gpus->nr_cards; i++) {
+            const struct device *dev = gpus->cards[i];
+            get_bdf(dev, bdf, sizeof(bdf));
+            if (!read_runtime_pm_value(bdf, residency[r].attribute, &value))
+                continue;
+            fprintf(file, "%s{bdf=\"%s\",vendor=\"%04x\",device=\"%04x\",boot_vga=\"%d\"} %lld.%03lld\n",
+                    residency[r].name, bdf, dev->vendor_id, dev->device_id,
+                    dev->boot_vga, value / 1000, value % 1000);
+        }
+    }
+
+    fprintf(file, "# HELP gpu_manager_runtime_status Current runtime PM status of the GPU.\n");
+    fprintf(file, "# TYPE gpu_manager_runtime_status gauge\n");
+    for (int i = 0; i < gpus->nr_cards; i++) {
+        get_bdf(gpus->cards[i], bdf, sizeof(bdf));
+        snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/power/runtime_status", bdf);
+        if (!read_sysfs_attribute(path, status, sizeof(status)))
+            continue;
+        for (size_t s = 0; s < sizeof(runtime_states) / sizeof(runtime_states[0]); s++) {
+            snprintf(labels, sizeof(labels), "bdf=\"%s\",status=\"%s\"", bdf, runtime_states[s]);
+            fprintf(file, "gpu_manager_runtime_status{%s} %d\n", labels,
+                    strcmp(status, runtime_states[s]) == 0);
+        }
+    }
+
+    fprintf(file, "# HELP gpu_manager_prime_mode PRIME mode applied in the last run.\n");
+    fprintf(file, "# TYPE gpu_manager_prime_mode gauge\n");
+    for (prime_mode_settings mode = ON; mode <= ONDEMAND; mode++) {
+        fprintf(file, "gpu_manager_prime_mode{mode=\"%s\"} %d\n",
+                prime_mode_to_string(mode),
+                decision->action == ACTION_PRIME && decision->prime_mode == mode);
+    }
+
+    fprintf(file, "# HELP gpu_manager_last_decision_timestamp_seconds Time of the last decision.\n");
+    fprintf(file, "# TYPE gpu_manager_last_decision_timestamp_seconds gauge\n");
+    fprintf(file, "gpu_manager_last_decision_timestamp_seconds{action=\"%s\",discrete=\"%s\"} %lld\n",
+            action_names[decision->action], decision->discrete,
+            (long long)decision->timestamp);
+}
+
+
+/* Write the metrics to the textfile collector path, if any, or to stdout.
+ * The file is replaced atomically, so that the collector never reads a
+ * partial file.
+ */
+static bool export_metrics(struct gpus *gpus, const struct decision *decision)
+{
+    char tmp_path[PATH_MAX];
+    FILE *file;
+
+    if (!metrics_textfile) {
+        write_metrics(stdout, gpus, decision);
+        fflush(stdout);
+        return true;
+    }
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", metrics_textfile, (int)getpid());
+    file = fopen(tmp_path, "w");
+    if (!file) {
+        log_msg(GPU_MANAGER_LOG_ERR, "Error: can't open %s for writing\n", tmp_path);
+        return false;
+    }
+
+    write_metrics(file, gpus, decision);
+
+    if (fclose(file) != 0 || rename(tmp_path, metrics_textfile) != 0) {
+        log_msg(GPU_MANAGER_LOG_ERR, "Error: can't write metrics to %s\n", metrics_textfile);
+        unlink(tmp_path);
+        return false;
+    }
+
+    log_msg(GPU_MANAGER_LOG_INFO, "Metrics written to %s\n", metrics_textfile);
+    return true;
+}
+
+
+static bool unload_nvidia(void) {
+    unload_module("nvidia-drm");
+    unload_module("nvidia-uvm");
+    unload_module("nvidia-modeset");
+
+    return unload_module("nvidia");
+}
+
+static char* get_pid_by_name(const char *name) {
+    char *argv[] = { "/bin/pidof", (char *)name, NULL };
+    char *pid = NULL;
+
+    log_msg(GPU_MANAGER_LOG_DEBUG, "Calling %s %s\n", argv[0], name);
+    pid = get_output(argv, NULL, NULL);
+
+    if (!pid) {
+        log_msg(GPU_MANAGER_LOG_INFO, "Info: no PID found for %s.\n",
+                name);
+        return NULL;
+    }
+
+    return pid;
+}
+
+
+static long get_uid_of_pid(const char *pid) {
+    char path[PATH_MAX];
+
+    _cleanup_free_ char *line = NULL;
+    _cleanup_fclose_ FILE *file = NULL;
+    size_t len = 0;
+    char pattern[] = "Uid:";
+    long uid = -1;
+
+    snprintf(path, sizeof(path),
+             "/proc/%s/status",
+             pid);
+    log_msg(GPU_MANAGER_LOG_DEBUG, "Opening %s\n", path);
+
+    file = fopen(path, "r");
+    if (file == NULL) {
+        log_msg(GPU_MANAGER_LOG_ERR, "Error: can't open %s\n", path);
+        return -1;
+    }
+    while (getline(&line, &len, file) != -1) {
+        if (istrstr(line, pattern) != NULL) {
+            log_msg(GPU_MANAGER_LOG_DEBUG, "found \"%s\"\n", line);
+            if (strncmp(line, "Uid:", 4) == 0) {
+                uid = strtol(line + 4, NULL, 10);
+                log_msg(GPU_MANAGER_LOG_DEBUG, "Found %ld\n", uid);
+            }
+        }
+    }
+    return uid;
+}
+
+
+static char* get_user_from_uid(const long uid) {
+    char *token, *str;
+    char pattern[PATH_MAX];
+    char *user = NULL;
+    size_t len = 0;
+    _cleanup_free_ char *line = NULL;
+    _cleanup_fclose_ FILE *file = NULL;
+    _cleanup_free_ char *tofree = NULL;
+
+    snprintf(pattern, sizeof(pattern),
+             "%ld",
+             uid);
+    log_msg(GPU_MANAGER_LOG_DEBUG, "Looking for %s\n", pattern);
+
+    file = fopen("/etc/passwd", "r");
+    if (file == NULL)
+         return NULL;
+    while (getline(&line, &len, file) != -1 && (user == NULL)) {
+        if (istrstr(line, pattern) != NULL) {
+            tofree = str = strdup(line);
+            /* Get the first result
+             * gdm:x:120:125:Gnome Display Manager:/var/lib/gdm3:/bin/false
+             */
+            while( (token = strsep(&str, ":")) != NULL ) {
+                user = strdup(token);
+                log_msg(GPU_MANAGER_LOG_DEBUG, "USER: %s\n", user);
+                break;
+            }
+        }
+    }
+    return user;
+}
+
+
+/* Check a strings with pids, and find the gdm session */
+static long find_pid_main_session(const char *pid_str) {
+    _cleanup_free_ char *tofree = NULL;
+    _cleanup_free_ char *user = NULL;
+    long uid = -1;
+    char *token, *str;
+    long pid = -1;
+
+    tofree = str = strdup(pid_str);
+    while( (token = strsep(&str," ")) != NULL ) {
+        if ( (uid = get_uid_of_pid(token)) >= 0) {
+            log_msg(GPU_MANAGER_LOG_DEBUG, "Found: %s %ld\n", token, uid);
+            /*look up the UID in /etc/passwd */
+            user = get_user_from_uid(uid);
+            log_msg(GPU_MANAGER_LOG_DEBUG, "User: %s UID: %ld\n", user, uid);
+            if ((user != NULL) && (strcmp(user, "gdm") == 0)) {
+                pid = strtol(token, NULL, 10);
+                break;
+            }
+        }
+    }
+    return pid;
+}
+
+
+static long get_gdm_session_pid(const char* display_server) {
+    _cleanup_free_ char *pid_str = NULL;
+    long pid = -1;
+
+    pid_str = get_pid_by_name(display_server);
+    if (!pid_str) {
+        log_msg(GPU_MANAGER_LOG_INFO, "INFO: no PID found for %s.\n",
+                display_server);
+        return -1;
+    }
+
+    log_msg(GPU_MANAGER_LOG_INFO, "INFO: found PID(s) %s for %s.\n",
+                    pid_str, display_server);
+
+    pid = find_pid_main_session(pid_str);
+
+    log_msg(GPU_MANAGER_LOG_INFO, "INFO: found PID %ld for Gdm main %s session.\n",
+            pid, display_server);
+
+    return pid;
+}
+
+
+/* Kill the main display session created by Gdm 3 */
+static bool kill_main_display_session (void) {
+    int i;
+    char server[] = "Xwayland";
+    long pid = -1;
+    int status = 0;
+    /* try with Xwayland first */
+    char *servers[2] = {"Xwayland", "Xorg"};
+
+    if (!dry_run) {
+        for(i = 0; i < 2; i++) {
+            pid = get_gdm_session_pid(servers[i]);
+            if (pid <= 0)
+                log_msg(GPU_MANAGER_LOG_INFO, "Info: no PID found for %s.\n", servers[i]);
+            else
+                break;
+        }
+        if (pid <= 0)
+            return false;
+
+        log_msg(GPU_MANAGER_LOG_INFO, "Info: found PID(s) %ld for %s.\n",
+                pid, server);
+
+        /* Kill the session */
+        log_msg(GPU_MANAGER_LOG_INFO, "Killing %ld\n", pid);
+        status = kill((pid_t)pid, SIGKILL);
+    }
+    return (status == 0);
+}
+
+
+/* The steps to switch to a PRIME mode, planned before anything is
+ * changed, so that they can be shown, run concurrently and undone
+ */
+typedef enum {
+    STEP_CREATE_OUTPUTCLASS,
+    STEP_REMOVE_OUTPUTCLASS,
+    STEP_CREATE_SERVERLAYOUT,
+    STEP_REMOVE_SERVERLAYOUT,
+    STEP_ENABLE_RUNTIME_PM,
+    STEP_DISABLE_RUNTIME_PM,
+    STEP_LOAD_NVIDIA,
+    STEP_UNLOAD_NVIDIA,
+} plan_step_type;
+
+static const char *plan_step_names[] = {
+    [STEP_CREATE_OUTPUTCLASS] = "+ 11-nvidia-prime.conf",
+    [STEP_REMOVE_OUTPUTCLASS] = "- 11-nvidia-prime.conf",
+    [STEP_CREATE_SERVERLAYOUT] = "+ 11-nvidia-offload.conf",
+    [STEP_REMOVE_SERVERLAYOUT] = "- 11-nvidia-offload.conf",
+    [STEP_ENABLE_RUNTIME_PM] = "~ power/control: auto",
+    [STEP_DISABLE_RUNTIME_PM] = "~ power/control: on",
+    [STEP_LOAD_NVIDIA] = "+ nvidia",
+    [STEP_UNLOAD_NVIDIA] = "- nvidia",
+};
+
+struct plan_step {
+    plan_step_type type;
+    /* Module steps run in their own thread, next to the other steps */
+    bool module_step;
+    /* If this fails, the steps already done are undone. Only the
+     * snippets and the nvidia load are critical: a busy nvidia is left
+     * loaded
+     */
+    bool critical;
+    bool done;
+    bool status;
+    /* What to restore: whether the file existed, or runtime PM was on */
+    bool was_set;
+};
+
+#define MAX_PLAN_STEPS 8
+
+struct prime_plan {
+    const struct device *device;
+    prime_mode_settings mode;
+    /* Switching while the display session runs: never stop it */
+    bool live;
+    struct plan_step steps[MAX_PLAN_STEPS];
+    int nr_steps;
+};
+
+
+static void add_plan_step(struct prime_plan *plan, plan_step_type type, bool critical)
+{
+    struct plan_step *step = &plan->steps[plan->nr_steps++];
+
+    *step = (struct plan_step){ .type = type, .critical = critical };
+    step->module_step = type == STEP_LOAD_NVIDIA || type == STEP_UNLOAD_NVIDIA;
+}
+
+
+static bool is_runtime_pm_enabled(const struct device *device)
+{
+    char path[PATH_MAX];
+    char bdf[32];
+    char control[16];
+
+    get_bdf(device, bdf, sizeof(bdf));
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/power/control", bdf);
+
+    return read_sysfs_attribute(path, control, sizeof(control)) &&
+           strcmp(control, "auto") == 0;
+}
+
+
+/* Plan what enable_prime() or apply_prime_delta() has to change for
+ * the mode
+ */
+static void build_prime_plan(struct prime_plan *plan, const struct device *device,
+                             prime_mode_settings mode, bool live)
+{
+    bool has_outputclass = has_xorg_d_custom_file("11-nvidia-prime.conf");
+    bool has_serverlayout = has_xorg_d_custom_file("11-nvidia-offload.conf");
+    bool nvidia_loaded = is_module_loaded("nvidia");
+
+    plan->device = device;
+    plan->mode = mode;
+    plan->live = live;
+    plan->nr_steps = 0;
+
+    if (mode == ON) {
+        /* Create an OutputClass just for PRIME, to override
+         * the default NVIDIA settings, and remove the ServerLayout
+         */
+        add_plan_step(plan, STEP_CREATE_OUTPUTCLASS, true);
+        if (has_serverlayout)
+            add_plan_step(plan, STEP_REMOVE_SERVERLAYOUT, true);
+        add_plan_step(plan, STEP_DISABLE_RUNTIME_PM, false);
+        if (!nvidia_loaded)
+            add_plan_step(plan, STEP_LOAD_NVIDIA, true);
+    }
+    else if (mode == ONDEMAND) {
+        /* Create the ServerLayout required to enabling offload
+         * for NVIDIA, and remove the OutputClass
+         */
+        add_plan_step(plan, STEP_CREATE_SERVERLAYOUT, true);
+        if (has_outputclass)
+            add_plan_step(plan, STEP_REMOVE_OUTPUTCLASS, true);
+        add_plan_step(plan, STEP_ENABLE_RUNTIME_PM, false);
+        if (!nvidia_loaded)
+            add_plan_step(plan, STEP_LOAD_NVIDIA, true);
+    }
+    else {
+        /* Remove the OutputClass and ServerLayout, unload the NVIDIA
+         * modules and set power control to "auto" to save power
+         */
+        if (has_outputclass)
+            add_plan_step(plan, STEP_REMOVE_OUTPUTCLASS, true);
+        if (has_serverlayout)
+            add_plan_step(plan, STEP_REMOVE_SERVERLAYOUT, true);
+        if (nvidia_loaded && !keeps_module_loaded(device))
+            add_plan_step(plan, STEP_UNLOAD_NVIDIA, false);
+        add_plan_step(plan, STEP_ENABLE_RUNTIME_PM, false);
+    }
+}
+
+
+static void print_prime_plan(const struct prime_plan *plan)
+{
+    log_msg(GPU_MANAGER_LOG_INFO, "Plan for PRIME mode %s:\n", prime_mode_to_string(plan->mode));
+    for (int i = 0; i < plan->nr_steps; i++)
+        log_msg(GPU_MANAGER_LOG_INFO, "  %s\n", plan_step_names[plan->steps[i].type]);
+}
+
+
+static void run_plan_step(const struct prime_plan *plan, struct plan_step *step)
+{
+    switch (step->type) {
+    case STEP_CREATE_OUTPUTCLASS:
+        step->was_set = has_xorg_d_custom_file("11-nvidia-prime.conf");
+        step->status = create_prime_outputclass();
+        break;
+    case STEP_REMOVE_OUTPUTCLASS:
+        step->status = remove_prime_outputclass() == 0;
+        break;
+    case STEP_CREATE_SERVERLAYOUT:
+        step->was_set = has_xorg_d_custom_file("11-nvidia-offload.conf");
+        step->status = create_offload_serverlayout();
+        break;
+    case STEP_REMOVE_SERVERLAYOUT:
+        step->status = remove_offload_serverlayout() == 0;
+        break;
+    case STEP_ENABLE_RUNTIME_PM:
+    case STEP_DISABLE_RUNTIME_PM:
+        step->was_set = is_runtime_pm_enabled(plan->device);
+        step->status = manage_power_management(plan->device,
+                                               step->type == STEP_ENABLE_RUNTIME_PM);
+        break;
+    case STEP_LOAD_NVIDIA:
+        step->status = load_module("nvidia");
+        break;
+    case STEP_UNLOAD_NVIDIA:
+        step->status = unload_nvidia() || !is_module_loaded("nvidia");
+        break;
+    }
+    step->done = true;
+}
+
+
+static void undo_plan_step(const struct prime_plan *plan, const struct plan_step *step)
+{
+    log_msg(GPU_MANAGER_LOG_INFO, "Rolling back: %s\n", plan_step_names[step->type]);
+
+    switch (step->type) {
+    case STEP_CREATE_OUTPUTCLASS:
+        if (!step->was_set)
+            remove_prime_outputclass();
+        break;
+    case STEP_REMOVE_OUTPUTCLASS:
+        create_prime_outputclass();
+        break;
+    case STEP_CREATE_SERVERLAYOUT:
+        if (!step->was_set)
+            remove_offload_serverlayout();
+        break;
+    case STEP_REMOVE_SERVERLAYOUT:
+        create_offload_serverlayout();
+        break;
+    case STEP_ENABLE_RUNTIME_PM:
+    case STEP_DISABLE_RUNTIME_PM:
+        manage_power_management(plan->device, step->was_set);
+        break;
+    case STEP_LOAD_NVIDIA:
+        unload_nvidia();
+        break;
+    case STEP_UNLOAD_NVIDIA:
+        load_module("nvidia");
+        break;
+    }
+}
+
+
+static void *run_module_steps(void *data)
+{
+    struct prime_plan *plan = data;
+
+    for (int i = 0; i < plan->nr_steps; i++) {
+        if (plan->steps[i].module_step)
+            run_plan_step(plan, &plan->steps[i]);
+    }
+
+    return NULL;
+}
+
+
+/* Run the module steps in a thread while the files are written, then
+ * undo everything if a critical step failed. Otherwise, stop the display
+ * session if it keeps nvidia from being unloaded.
+ */
+static bool execute_prime_plan(struct prime_plan *plan)
+{
+    pthread_t thread;
+    bool threaded = pthread_create(&thread, NULL, run_module_steps, plan) == 0;
+    struct plan_step *failed = NULL;
+
+    for (int i = 0; i < plan->nr_steps; i++) {
+        if (!plan->steps[i].module_step)
+            run_plan_step(plan, &plan->steps[i]);
+    }
+    if (threaded)
+        pthread_join(thread, NULL);
+    else
+        run_module_steps(plan);
+
+    for (int i = 0; i < plan->nr_steps && !failed; i++) {
+        if (plan->steps[i].critical && !plan->steps[i].status)
+            failed = &plan->steps[i];
+    }
+
+    if (failed) {
+        log_msg(GPU_MANAGER_LOG_ERR, "Error: step \"%s\" failed\n", plan_step_names[failed->type]);
+        for (int i = plan->nr_steps - 1; i >= 0; i--) {
+            if (plan->steps[i].done && plan->steps[i].status)
+                undo_plan_step(plan, &plan->steps[i]);
+        }
+        return false;
+    }
+
+    for (int i = 0; i < plan->nr_steps; i++) {
+        struct plan_step *step = &plan->steps[i];
+
+        if (step->type != STEP_UNLOAD_NVIDIA || step->status)
+            continue;
+
+        if (plan->live) {
+            log_msg(GPU_MANAGER_LOG_WARNING, "Warning: nvidia is in use, leaving it loaded\n");
+            continue;
+        }
+
+        /* The display session may hold on to nvidia. Now that the
+         * snippets are gone, it won't load it again once restarted.
+         */
+        log_msg(GPU_MANAGER_LOG_WARNING, "Warning: failure to unload the nvidia modules.\n");
+        log_msg(GPU_MANAGER_LOG_INFO, "Info: killing X...\n");
+        if (kill_main_display_session())
+            run_plan_step(plan, step);
+        if (!step->status)
+            log_msg(GPU_MANAGER_LOG_ERR, "Error: giving up on unloading nvidia...\n");
+    }
+
+    return true;
+}
+
+
+static bool enable_prime(const char *path, const struct device *device,
+                         prime_mode_settings *applied_mode)
+{
+    prime_mode_settings prime_mode = OFF;
+    struct prime_plan plan;
+
+    /* Check if prime_settings is available
+     * File doesn't exist or empty
+     */
+    if (!exists_not_empty(path)) {
+        log_msg(GPU_MANAGER_LOG_WARNING, "Warning: no settings for prime can be found in %s.\n", path);
+
+       /* Try to create the file */
+        if (!create_prime_settings(path)) {
+            log_msg(GPU_MANAGER_LOG_ERR, "Error: failed to create %s\n", path);
+            return false;
+        }
+    }
+
+    prime_mode = get_device_prime_mode(path, device);
+    *applied_mode = prime_mode;
+
+    build_prime_plan(&plan, device, prime_mode, false);
+    print_prime_plan(&plan);
+    if (!execute_prime_plan(&plan))
+        return false;
+
+    /* Check that the policy actually took effect */
+    verify_power_management(device, prime_mode != ON);
+
+    return true;
+}
+
+
+/* Whether the xorg.conf.d snippets are the ones of the PRIME mode */
+static bool has_prime_snippets(prime_mode_settings mode)
+{
+    return has_xorg_d_custom_file("11-nvidia-prime.conf") == (mode == ON) &&
+           has_xorg_d_custom_file("11-nvidia-offload.conf") == (mode == ONDEMAND);
+}
+
+
+/* Switch to another PRIME mode while the system is running, with the
+ * same plan as enable_prime(). Unlike enable_prime(), this never stops
+ * the display session: if nvidia is in use, it stays loaded until it's
+ * released.
+ */
+static bool apply_prime_delta(const struct device *device, prime_mode_settings mode)
+{
+    struct prime_plan plan;
+
+    build_prime_plan(&plan, device, mode, true);
+    print_prime_plan(&plan);
+
+    return execute_prime_plan(&plan);
+}
+
+
+/* The inotify watches on the PRIME settings and on the snippets */
+struct prime_watch {
+    int fd;
+    int settings_wd;
+    int xorg_wd;
+    const char *settings_name;
+};
+
+
+/* Wait up to timeout_ms (forever if negative) for a change to the
+ * files we care about. Return 1 on a change, 0 on timeout, or a
+ * negative errno
+ */
+static int wait_for_prime_change(const struct prime_watch *watch, int timeout_ms)
+{
+    char buffer[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd = { .fd = watch->fd, .events = POLLIN };
+    long long deadline = get_monotonic_ms() + timeout_ms;
+    int remaining = timeout_ms;
+
+    for (;;) {
+        ssize_t len;
+        int ret = poll(&pfd, 1, remaining);
+
+        if (ret < 0 && errno != EINTR)
+            return -errno;
+        if (ret == 0)
+            return 0;
+
+        len = ret < 0 ? -1 : read(watch->fd, buffer, sizeof(buffer));
+        if (len < 0 && errno != EINTR && errno != EAGAIN)
+            return -errno;
+
+        for (char *ptr = buffer; len > 0 && ptr < buffer + len;) {
+            const struct inotify_event *event = (const struct inotify_event *)ptr;
+
+            if (event->mask & IN_Q_OVERFLOW)
+                return 1;
+            if (event->len > 0 &&
+                ((event->wd == watch->settings_wd &&
+                  strcmp(event->name, watch->settings_name) == 0) ||
+                 (event->wd == watch->xorg_wd && starts_with(event->name, "11-nvidia-"))))
+                return 1;
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+
+        if (timeout_ms >= 0) {
+            remaining = (int)(deadline - get_monotonic_ms());
+            if (remaining <= 0)
+                return 0;
+        }
+    }
+}
+
+
+/* Apply the changes to the PRIME settings as they happen, until an
+ * error occurs
+ */
+static int watch_prime_settings(const struct device *device, struct decision *decision)
+{
+    const uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE;
+    _cleanup_free_ char *settings_dir = strdup(prime_settings);
+    struct prime_watch watch = { .fd = -1 };
+    char *slash;
+    int status = 0;
+
+    if (!settings_dir)
+        return -ENOMEM;
+
+    /* Watch the directories, as the files tend to be replaced */
+    slash = strrchr(settings_dir, '/');
+    if (slash) {
+        *slash = '\0';
+        watch.settings_name = prime_settings + (slash - settings_dir) + 1;
+    }
+    else {
+        watch.settings_name = prime_settings;
+        free(settings_dir);
+        settings_dir = strdup(".");
+        if (!settings_dir)
+            return -ENOMEM;
+    }
+
+    watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch.fd < 0)
+        return -errno;
+    watch.settings_wd = inotify_add_watch(watch.fd, settings_dir[0] ? settings_dir : "/", mask);
+    watch.xorg_wd = inotify_add_watch(watch.fd, xorg_conf_d_path, mask);
+    if (watch.settings_wd < 0 || watch.xorg_wd < 0) {
+        status = -errno;
+        log_msg(GPU_MANAGER_LOG_ERR, "Error: can't watch %s or %s\n", prime_settings, xorg_conf_d_path);
+        close(watch.fd);
+        return status;
+    }
+
+    log_msg(GPU_MANAGER_LOG_INFO, "Watching %s in PRIME mode %s\n", prime_settings,
+            prime_mode_to_string(decision->prime_mode));
+
+    for (;;) {
+        prime_mode_settings mode;
+        long long first, settled, applied;
+
+        status = wait_for_prime_change(&watch, -1);
+        if (status < 0)
+            break;
+
+        /* Let bursts of writes settle */
+        first = get_monotonic_ms();
+        while ((status = wait_for_prime_change(&watch, watch_debounce_ms)) > 0)
+            ;
+        if (status < 0)
+            break;
+        settled = get_monotonic_ms();
+
+        if (!prime_mode_override && !exists_not_empty(prime_settings)) {
+            log_msg(GPU_MANAGER_LOG_INFO, "No PRIME settings in %s, keeping %s\n", prime_settings,
+                    prime_mode_to_string(decision->prime_mode));
+            continue;
+        }
+        mode = get_device_prime_mode(prime_settings, device);
+        if (mode == decision->prime_mode && has_prime_snippets(mode))
+            continue;
+
+        if (mode == decision->prime_mode)
+            log_msg(GPU_MANAGER_LOG_INFO, "Restoring the snippets of PRIME mode %s\n",
+                    prime_mode_to_string(mode));
+        else
+            log_msg(GPU_MANAGER_LOG_INFO, "PRIME mode changed from %s to %s\n",
+                    prime_mode_to_string(decision->prime_mode), prime_mode_to_string(mode));
+
+        if (!apply_prime_delta(device, mode)) {
+            log_msg(GPU_MANAGER_LOG_ERR, "Error: can't switch to PRIME mode %s, keeping %s\n",
+                    prime_mode_to_string(mode), prime_mode_to_string(decision->prime_mode));
+            while (wait_for_prime_change(&watch, 0) > 0)
+                ;
+            continue;
+        }
+        decision->prime_mode = mode;
+        decision->timestamp = time(NULL);
+        if (!dry_run)
+            write_decision_to_file(last_decision_file, decision);
+        applied = get_monotonic_ms();
+
+        /* Forget the events caused by our own changes */
+        while (wait_for_prime_change(&watch, 0) > 0)
+            ;
+
+        log_msg(GPU_MANAGER_LOG_INFO, "Applied PRIME mode %s in %lld ms, %lld ms after the first change\n",
+                prime_mode_to_string(mode), applied - settled, applied - first);
+    }
+
+    close(watch.fd);
+    return status;
+}
+
+
+/* Power down the discrete GPUs turned off by their policy, for the
+ * decisions which don't go through PRIME
+ */
+static void power_down_off_discretes(struct gpus *gpus)
+{
+    for (int i = 0; i < gpus->nr_cards; i++) {
+        const struct device *dev = gpus->cards[i];
+        const struct gpu_policy *policy;
+
+        if (dev->boot_vga)
+            continue;
+
+        policy = find_gpu_policy(dev);
+        if (policy && policy->mode == OFF && policy->match != POLICY_ANY)
+            enable_power_management(dev);
+    }
+}
+
+
+static void power_down_other_discretes(struct gpus *gpus, const struct device *selected)
+{
+    for (int i = 0; i < gpus->nr_cards; i++) {
+        const struct device *dev = gpus->cards[i];
+
+        if (dev->boot_vga || dev == selected)
+            continue;
+
+        enable_power_management(dev);
+    }
+}
+
+/* Enable PRIME on the selected discrete GPU and record the decision */
+static bool apply_prime(struct gpus *gpus, const struct device *discrete,
+                        struct decision *decision)
+{
+    if (!enable_prime(prime_settings, discrete, &decision->prime_mode))
+        return false;
+
+    decision->action = ACTION_PRIME;
+    get_bdf(discrete, decision->discrete, sizeof(decision->discrete));
+
+    /* Power down the discrete GPUs we don't use */
+    power_down_other_discretes(gpus, discrete);
+
+    /* Write permanent settings about offloading */
+    set_offloading();
+
+    return true;
+}
+
+static void free_devices(struct gpus *gpus)
+{
+    for (int i = 0; i < MAX_NR_CARDS; i++) {
+        if (gpus->cards[i]) {
+            free(gpus->cards[i]);
+            gpus->cards[i] = NULL;
+        }
+    }
+
+    gpus->nr_cards = 0;
+    gpus->nr_passthrough = 0;
+}
+
+#define PCI_CLASS_DISPLAY       0x03
+
+static inline bool is_display_controller(const struct pci_device *pci)
+{
+    return ((pci->device_class >> 16) & 0xFF) == PCI_CLASS_DISPLAY;
+}
+
+
+/* Parse a PCIe link speed such as "8.0 GT/s PCIe" into MT/s */
+static unsigned int parse_link_speed(const char *speed)
+{
+    unsigned int integer = 0, decimal = 0;
+
+    if (sscanf(speed, "%u.%1u", &integer, &decimal) < 1)
+        return 0;
+
+    return integer * 1000 + decimal * 100;
+}
+
+
+static void get_pci_link(const char *bdf, const char *attribute, unsigned int *speed,
+                         unsigned int *width)
+{
+    char path[PATH_MAX];
+    char buf[64];
+
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/%s_link_speed", bdf, attribute);
+    *speed = read_sysfs_attribute(path, buf, sizeof(buf)) ? parse_link_speed(buf) : 0;
+
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/%s_link_width", bdf, attribute);
+    *width = read_sysfs_attribute(path, buf, sizeof(buf)) ? (unsigned int)strtoul(buf, NULL, 10) : 0;
+}
+
+
+/* Collect the NUMA node, the local CPUs, the PCIe link state and the size
+ * of the BARs of the device from sysfs
+ */
+static void get_device_topology(struct device *dev)
+{
+    char bdf[32];
+    char path[PATH_MAX];
+    char buf[64];
+    unsigned long long start, end, flags;
+    _cleanup_fclose_ FILE *file = NULL;
+
+    get_bdf(dev, bdf, sizeof(bdf));
+
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/numa_node", bdf);
+    dev->numa_node = read_sysfs_attribute(path, buf, sizeof(buf)) ? atoi(buf) : -1;
+
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/local_cpulist", bdf);
+    if (!read_sysfs_attribute(path, dev->local_cpulist, sizeof(dev->local_cpulist)))
+        dev->local_cpulist[0] = '\0';
+
+    get_pci_link(bdf, "current", &dev->cur_link_speed, &dev->cur_link_width);
+    get_pci_link(bdf, "max", &dev->max_link_speed, &dev->max_link_width);
+
+    /* Each line of "resource" holds the start, end and flags of a region,
+     * starting with the BARs
+     */
+    memset(dev->bar_size, 0, sizeof(dev->bar_size));
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/resource", bdf);
+    file = fopen(path, "r");
+    for (size_t bar = 0; file && bar < NR_BARS; bar++) {
+        if (fscanf(file, "%llx %llx %llx", &start, &end, &flags) != 3)
+            break;
+        if (end > start)
+            dev->bar_size[bar] = end - start + 1;
+    }
+
+    log_msg(GPU_MANAGER_LOG_DEBUG, "  NUMA node: %d, local CPUs: %s\n",
+            dev->numa_node, dev->local_cpulist[0] ? dev->local_cpulist : "unknown");
+    log_msg(GPU_MANAGER_LOG_DEBUG, "  PCIe link: %u.%u GT/s x%u (max %u.%u GT/s x%u)\n",
+            dev->cur_link_speed / 1000, (dev->cur_link_speed % 1000) / 100, dev->cur_link_width,
+            dev->max_link_speed / 1000, (dev->max_link_speed % 1000) / 100, dev->max_link_width);
+    for (size_t bar = 0; bar < NR_BARS; bar++) {
+        if (dev->bar_size[bar])
+            log_msg(GPU_MANAGER_LOG_DEBUG, "  BAR %zu: %llu KiB\n", bar, dev->bar_size[bar] >> 10);
+    }
+}
+
+
+/* Get the address of the bridge the device is behind, from its position
+ * in the sysfs device hierarchy
+ */
+static bool get_upstream_bridge(const char *bdf, char *buf, size_t size)
+{
+    char path[PATH_MAX];
+    char resolved[PATH_MAX];
+    char *slash;
+    unsigned int domain, bus, dev, func;
+
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s", bdf);
+    if (!realpath(path, resolved))
+        return false;
+
+    slash = strrchr(resolved, '/');
+    if (!slash)
+        return false;
+    *slash = '\0';
+
+    slash = strrchr(resolved, '/');
+    if (!slash || sscanf(slash + 1, "%x:%x:%x.%x", &domain, &bus, &dev, &func) != 4)
+        return false;
+
+    snprintf(buf, size, "%s", slash + 1);
+    return true;
+}
+
+
+/* See if a link trained below its maximum width. An unknown current
+ * width (e.g. the device is in D3cold) is not a degraded link. A lower
+ * speed is only logged, as ASPM and idle GPUs lower it all the time.
+ */
+static int check_link(const char *bdf, unsigned int cur_speed, unsigned int cur_width,
+                      unsigned int max_speed, unsigned int max_width,
+                      int width_flag)
+{
+    int health = 0;
+
+    if (!cur_speed || !cur_width)
+        return 0;
+
+    if (cur_width < max_width) {
+        log_msg(GPU_MANAGER_LOG_WARNING, "Warning: the PCIe link of %s is x%u instead of x%u\n",
+                bdf, cur_width, max_width);
+        health |= width_flag;
+    }
+    if (cur_speed < max_speed) {
+        log_msg(GPU_MANAGER_LOG_INFO, "The PCIe link of %s runs at %u.%u GT/s out of %u.%u GT/s\n",
+                bdf, cur_speed / 1000, (cur_speed % 1000) / 100,
+                max_speed / 1000, (max_speed % 1000) / 100);
+    }
+
+    return health;
+}
+
+
+/* Compare the link of the GPU and of its upstream bridge with what
+ * both ends can do
+ */
+static void check_link_health(struct device *dev)
+{
+    char bdf[32];
+    char bridge[64];
+    unsigned int cur_speed, cur_width, max_speed, max_width;
+
+    get_bdf(dev, bdf, sizeof(bdf));
+
+    dev->link_health = check_link(bdf, dev->cur_link_speed, dev->cur_link_width,
+                                  dev->max_link_speed, dev->max_link_width,
+                                  LINK_WIDTH_DEGRADED);
+
+    if (get_upstream_bridge(bdf, bridge, sizeof(bridge))) {
+        get_pci_link(bridge, "current", &cur_speed, &cur_width);
+        get_pci_link(bridge, "max", &max_speed, &max_width);
+        /* The port and the GPU share the link, which can't be wider or
+         * faster than the GPU: a x8 GPU in a x16 slot is fine
+         */
+        if (dev->max_link_width && dev->max_link_width < max_width)
+            max_width = dev->max_link_width;
+        if (dev->max_link_speed && dev->max_link_speed < max_speed)
+            max_speed = dev->max_link_speed;
+        dev->link_health |= check_link(bridge, cur_speed, cur_width, max_speed, max_width,
+                                       BRIDGE_WIDTH_DEGRADED);
+    }
+
+    log_msg(GPU_MANAGER_LOG_DEBUG, "  PCIe link health: %s\n", dev->link_health ? "degraded" : "ok");
+}
+
+
+/* Report the GPUs whose link health differs from the last boot */
+static bool has_link_health_changed(struct gpus *prev, struct gpus *current)
+{
+    bool changed = false;
+    char bdf[32];
+
+    for (int i = 0; i < current->nr_cards; i++) {
+        const struct device *cur = current->cards[i];
+
+        for (int j = 0; j < prev->nr_cards; j++) {
+            const struct device *old = prev->cards[j];
+
+            if (old->domain != cur->domain || old->bus != cur->bus ||
+                old->dev != cur->dev || old->func != cur->func)
+                continue;
+
+            if (old->link_health != cur->link_health) {
+                get_bdf(cur, bdf, sizeof(bdf));
+                log_msg(GPU_MANAGER_LOG_INFO, "The PCIe link health of %s has changed: 0x%x -> 0x%x (%s)\n",
+                        bdf, old->link_health, cur->link_health,
+                        cur->link_health ? "degraded" : "recovered");
+                changed = true;
+            }
+            break;
+        }
+    }
+
+    return changed;
+}
+
+
+/* FNV-1a hash of the cards, so that a change in the set of GPUs, or in
+ * their slots, shows up as a different fingerprint.
+ */
+static uint32_t get_devices_fingerprint(const struct gpus *gpus)
+{
+    uint32_t hash = 2166136261u;
+
+    for (int i = 0; i < gpus->nr_cards; i++) {
+        const struct device *dev = gpus->cards[i];
+        unsigned int values[] = { dev->vendor_id, dev->device_id, dev->domain,
+                                  dev->bus, dev->dev, dev->func };
+
+        for (size_t j = 0; j < sizeof(values) / sizeof(values[0]); j++) {
+            for (int byte = 0; byte < 4; byte++) {
+                hash ^= (values[j] >> (byte * 8)) & 0xff;
+                hash *= 16777619u;
+            }
+        }
+    }
+    return hash;
+}
+
+
+/* Open the journal, and create or reset it if the header is not valid,
+ * or doesn't match the size of the file
+ */
+static int open_journal(const char *filename, int flags, struct journal_header *header)
+{
+    struct stat st;
+    int fd = open(filename, flags | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+
+    if (pread(fd, header, sizeof(*header), 0) == sizeof(*header) &&
+        fstat(fd, &st) == 0 &&
+        header->magic == JOURNAL_MAGIC &&
+        header->version == JOURNAL_VERSION &&
+        header->record_size == sizeof(struct journal_record) &&
+        header->capacity == JOURNAL_CAPACITY &&
+        header->head < header->capacity &&
+        header->count <= header->capacity &&
+        st.st_size >= (off_t)(sizeof(*header) + (size_t)header->count * header->record_size))
+        return fd;
+
+    if ((flags & O_ACCMODE) == O_RDONLY) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(header, 0, sizeof(*header));
+    header->magic = JOURNAL_MAGIC;
+    header->version = JOURNAL_VERSION;
+    header->record_size = sizeof(struct journal_record);
+    header->capacity = JOURNAL_CAPACITY;
+    if (ftruncate(fd, 0) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+/* Append the record of this run to the journal, overwriting the oldest
+ * record if the journal is full. This costs two writes, whatever the size
+ * of the journal.
+ */
+static bool append_to_journal(const char *filename, const struct gpus *gpus,
+                              const struct decision *decision, uint32_t duration_ms)
+{
+    struct journal_header header;
+    struct journal_record record = {0};
+    struct utsname uname_data;
+    off_t offset;
+    int fd;
+
+    record.timestamp = decision->timestamp ? decision->timestamp : time(NULL);
+    record.duration_ms = duration_ms;
+    record.fingerprint = get_devices_fingerprint(gpus);
+    record.action = decision->action;
+    record.prime_mode = decision->prime_mode;
+    record.offloading = decision->offloading;
+    record.nr_cards = gpus->nr_cards;
+    for (int i = 0; i < gpus->nr_cards && i < JOURNAL_MAX_CARDS; i++) {
+        record.ids[i][0] = gpus->cards[i]->vendor_id;
+        record.ids[i][1] = gpus->cards[i]->device_id;
+    }
+    /* Long release strings are cut to the size of the record */
+    if (uname(&uname_data) == 0)
+        snprintf(record.release, sizeof(record.release), "%.*s",
+                 (int)sizeof(record.release) - 1, uname_data.release);
+    snprintf(record.discrete, sizeof(record.discrete), "%s", decision->discrete);
+
+    fd = open_journal(filename, O_RDWR | O_CREAT, &header);
+    if (fd < 0) {
+        log_msg(GPU_MANAGER_LOG_ERR, "Error: can't open the journal %s: %s\n", filename, strerror(errno));
+        return false;
+    }
+
+    offset = sizeof(header) + (off_t)header.head * sizeof(record);
+    header.head = (header.head + 1) % header.capacity;
+    if (header.count < header.capacity)
+        header.count++;
+
+    if (pwrite(fd, &record, sizeof(record), offset) != sizeof(record) ||
+        pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        log_msg(GPU_MANAGER_LOG_ERR, "Error: can't write to the journal %s\n", filename);
+        close(fd);
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+
+/* Print the records of the journal in the [since, until] range, from the
+ * oldest to the newest.
+ */
+static bool print_journal(FILE *file, const char *filename, long long since, long long until)
+{
+    struct journal_header header;
+    _cleanup_free_ struct journal_record *records = NULL;
+    ssize_t size;
+    int fd;
+
+    fd = open_journal(filename, O_RDONLY, &header);
+    if (fd < 0) {
+        fprintf(stderr, "Error: can't read the journal %s\n", filename);
+        return false;
+    }
+
+    records = calloc(header.capacity, sizeof(*records));
+    if (!records) {
+        close(fd);
+        return false;
+    }
+    /* One read for the whole ring */
+    size = pread(fd, records, header.capacity * sizeof(*records), sizeof(header));
+    close(fd);
+    if (size < (ssize_t)(header.count * sizeof(*records))) {
+        fprintf(stderr, "Error: the journal %s is truncated\n", filename);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < header.count; i++) {
+        const struct journal_record *record;
+        uint32_t slot = (header.head + header.capacity - header.count + i) % header.capacity;
+
+        record = &records[slot];
+        if (record->timestamp < since || record->timestamp > until)
+            continue;
+
+        fprintf(file, "%" PRId64 " %.*s %08" PRIx32 " %u",
+                record->timestamp, (int)sizeof(record->release), record->release,
+                record->fingerprint, record->nr_cards);
+        for (int card = 0; card < record->nr_cards && card < JOURNAL_MAX_CARDS; card++)
+            fprintf(file, "%s%04x:%04x", card ? "," : " ", record->ids[card][0], record->ids[card][1]);
+        fprintf(file, " action=%s prime_mode=%s offloading=%u discrete=%.*s duration_ms=%" PRIu32 "\n",
+                record->action < sizeof(action_names) / sizeof(action_names[0]) ?
+                    action_names[record->action] : "unknown",
+                prime_mode_to_string(record->prime_mode), record->offloading,
+                (int)sizeof(record->discrete), record->discrete[0] ? record->discrete : "none",
+                record->duration_ms);
+    }
+    return true;
+}
+
+
+/* Print the inventory from the last boot, with the topology of each GPU.
+ * This doesn't probe the hardware.
+ */
+static void print_inventory(FILE *file, struct gpus *gpus)
+{
+    char bdf[32];
+
+    for (int i = 0; i < gpus->nr_cards; i++) {
+        const struct device *dev = gpus->cards[i];
+
+        get_bdf(dev, bdf, sizeof(bdf));
+        fprintf(file, "%s vendor=%04x device=%04x boot_vga=%d numa_node=%d local_cpulist=%s "
+                      "link_speed=%u link_width=%u max_link_speed=%u max_link_width=%u "
+                      "link_health=%x bars=",
+                bdf, dev->vendor_id, dev->device_id, dev->boot_vga, dev->numa_node,
+                dev->local_cpulist[0] ? dev->local_cpulist : "-",
+                dev->cur_link_speed, dev->cur_link_width,
+                dev->max_link_speed, dev->max_link_width, dev->link_health);
+        for (size_t bar = 0; bar < NR_BARS; bar++)
+            fprintf(file, "%s%llu", bar ? "," : "", dev->bar_size[bar]);
+        fprintf(file, "\n");
+    }
+}
+
+
+/* Decide what to do with the devices, without touching the system.
+ * Return false if there is nothing to decide, e.g. without a boot VGA.
+ */
+static bool decide(struct gpus *gpus, const struct system_state *state,
+                   struct decision *decision, struct device **discrete)
+{
+    struct device *boot_device = NULL;
+    struct device *discrete_device = NULL;
+
+    memset(decision, 0, sizeof(*decision));
+    decision->action = ACTION_NONE;
+    decision->prime_mode = OFF;
+    decision->offloading = state->offloading;
+    *discrete = NULL;
+
+    /* Get data about the boot_vga card */
+    boot_device = get_boot_vga(gpus);
+    if (!boot_device) {
+        log_msg(GPU_MANAGER_LOG_INFO, "No boot display controller detected\n");
+        return false;
+    }
+
+    if (gpus->nr_cards == 1) {
+        log_msg(GPU_MANAGER_LOG_INFO, "Single card detected\n");
+
+        if ((boot_device->vendor_id == INTEL || boot_device->vendor_id == AMD) &&
+            state->offloading && state->nvidia_unloaded) {
+            /* NVIDIA PRIME */
+            log_msg(GPU_MANAGER_LOG_INFO, "PRIME detected\n");
+
+            /* Get the details of the disabled discrete from a file */
+            if (state->find_disabled_cards)
+                find_disabled_cards(gpu_detection_path, gpus, add_gpu_from_file);
+
+            discrete_device = select_discrete(gpus);
+            if (!discrete_device)
+                return true;
+
+            decision->action = ACTION_PRIME;
+        }
+        else if (boot_device->vendor_id == INTEL) {
+            log_msg(GPU_MANAGER_LOG_INFO, "Nothing to do\n");
+        }
+        else if (boot_device->vendor_id == AMD) {
+            if (state->has_changed && state->amdgpu_loaded && state->amdgpu_is_pro &&
+                state->amdgpu_pro_px_installed) {
+                /* If amdgpu-pro-px exists, we can assume it's a pxpress system. But now the
+                 * system has one card only, user probably disabled Switchable Graphics in
+                 * BIOS. So we need to use discrete config file here.
+                 */
+                log_msg(GPU_MANAGER_LOG_INFO, "AMDGPU-Pro discrete graphics detected\n");
+                decision->action = ACTION_AMDGPU_PRO_RESET;
+            }
+            else {
+                log_msg(GPU_MANAGER_LOG_INFO, "Nothing to do\n");
+            }
+        }
+        else if (boot_device->vendor_id == NVIDIA) {
+            if (!state->has_offload_layout) {
+                log_msg(GPU_MANAGER_LOG_INFO, "Nothing to do\n");
+            }
+            else {
+                decision->action = ACTION_REMOVE_OFFLOAD;
+            }
+        }
+    }
+    else if (gpus->nr_cards > 1) {
+        discrete_device = select_discrete(gpus);
+        if (!discrete_device)
+            return true;
+
+        /* Intel + another GPU */
+        if (boot_device->vendor_id == INTEL) {
+            log_msg(GPU_MANAGER_LOG_INFO, "Intel IGP detected\n");
+            /* AMDGPU-Pro Switchable */
+            if (state->has_changed && state->amdgpu_loaded && state->amdgpu_is_pro &&
+                state->amdgpu_pro_px_installed) {
+                /* Similar to switchable enabled -> disabled case, but this time
+                 * to deal with switchable disabled -> enabled change.
+                 */
+                log_msg(GPU_MANAGER_LOG_INFO, "AMDGPU-Pro switchable graphics detected\n");
+                decision->action = ACTION_AMDGPU_PRO_POWERSAVING;
+            }
+            /* NVIDIA Optimus */
+            else if (state->offloading && (state->intel_loaded && !state->nouveau_loaded &&
+                                 (state->nvidia_loaded || state->nvidia_kmod_available))) {
+                log_msg(GPU_MANAGER_LOG_INFO, "Intel hybrid system\n");
+                decision->action = ACTION_PRIME;
+            }
+            else {
+                /* Desktop system or Laptop with open drivers only */
+                log_msg(GPU_MANAGER_LOG_INFO, "Desktop system detected\n");
+                log_msg(GPU_MANAGER_LOG_INFO, "or laptop with open drivers\n");
+                log_msg(GPU_MANAGER_LOG_INFO, "Nothing to do\n");
+            }
+        }
+        /* AMD APU + NVIDIA */
+        else if (boot_device->vendor_id == AMD && discrete_device->vendor_id == NVIDIA) {
+            log_msg(GPU_MANAGER_LOG_INFO, "AMD IGP detected\n");
+            if (state->offloading && (state->amdgpu_loaded && !state->nouveau_loaded &&
+                               (state->nvidia_loaded || state->nvidia_kmod_available))) {
+                log_msg(GPU_MANAGER_LOG_INFO, "AMD hybrid system\n");
+                decision->action = ACTION_PRIME;
+            }
+            else {
+                /* Desktop system or Laptop with open drivers only */
+                log_msg(GPU_MANAGER_LOG_INFO, "Desktop system detected\n");
+                log_msg(GPU_MANAGER_LOG_INFO, "or laptop with open drivers\n");
+                log_msg(GPU_MANAGER_LOG_INFO, "Nothing to do\n");
+            }
+        }
+        else {
+                log_msg(GPU_MANAGER_LOG_INFO, "Unsupported discrete card vendor: %x\n", discrete_device->vendor_id);
+                log_msg(GPU_MANAGER_LOG_INFO, "Nothing to do\n");
+        }
+    }
+
+    if (decision->action == ACTION_PRIME) {
+        const struct gpu_policy *policy = find_gpu_policy(discrete_device);
+
+        decision->prime_mode = state->prime_mode;
+        if (!prime_mode_override && policy && policy->mode >= 0)
+            decision->prime_mode = (prime_mode_settings)policy->mode;
+        get_bdf(discrete_device, decision->discrete, sizeof(decision->discrete));
+        *discrete = discrete_device;
+    }
+
+    return true;
+}
+
+
+/* Carry out the decision, and downgrade it to ACTION_NONE if that fails */
+static void apply_decision(struct gpus *gpus, struct device *discrete, struct decision *decision)
+{
+    switch (decision->action) {
+    case ACTION_PRIME:
+        /* Try to enable prime */
+        if (!apply_prime(gpus, discrete, decision)) {
+            decision->action = ACTION_NONE;
+            decision->prime_mode = OFF;
+            decision->discrete[0] = '\0';
+            if (gpus->nr_cards > 1)
+                log_msg(GPU_MANAGER_LOG_INFO, "Nothing to do\n");
+        }
+        break;
+    case ACTION_AMDGPU_PRO_POWERSAVING:
+        if (!run_amdgpu_pro_px(MODE_POWERSAVING))
+            decision->action = ACTION_NONE;
+        break;
+    case ACTION_AMDGPU_PRO_RESET:
+        if (!run_amdgpu_pro_px(RESET))
+            decision->action = ACTION_NONE;
+        break;
+    case ACTION_REMOVE_OFFLOAD:
+        remove_offload_serverlayout();
+        break;
+    default:
+        break;
+    }
+
+    if (decision->action != ACTION_PRIME)
+        power_down_off_discretes(gpus);
+}
+
+
+/* Whether the comma separated list contains the name */
+static bool is_in_list(const char *list, const char *name)
+{
+    size_t len = strlen(name);
+
+    while (list && *list) {
+        if (strncmp(list, name, len) == 0 && (list[len] == ',' || list[len] == '\0'))
+            return true;
+        list = strchr(list, ',');
+        if (list)
+            list++;
+    }
+    return false;
+}
+
+
+/* Read one scenario per line, as whitespace separated key=value pairs:
+ *
+ *   id=<name> gpu=<device> [gpu=<device>...] loaded=<modules> unloaded=<modules>
+ *   available=<modules> versioned=<modules> offloading=<0|1> changed=<0|1>
+ *   amdgpu_pro_px=<0|1> offload_layout=<0|1> prime=<on|on-demand|off>
+ *
+ * where <device> is a line of the last_gfx_boot file and <modules> a comma
+ * separated list. Print the decision for each scenario, without touching
+ * the system. Lines starting with '#' are ignored.
+ */
+static void simulate(FILE *input, FILE *output)
+{
+    char line[4096];
+    unsigned long nr_line = 0;
+
+    while (fgets(line, sizeof(line), input)) {
+        struct gpus gpus = {0};
+        struct system_state state = {0};
+        struct decision decision;
+        struct device *discrete = NULL;
+        const char *id = NULL;
+        const char *loaded = NULL;
+        const char *unloaded = NULL;
+        const char *available = NULL;
+        const char *versioned = NULL;
+        bool amdgpu_pro_px = false;
+        bool valid = true;
+        char *saveptr = NULL;
+
+        nr_line++;
+        state.prime_mode = ON;
+
+        for (char *token = strtok_r(line, " \t\n", &saveptr); token;
+             token = strtok_r(NULL, " \t\n", &saveptr)) {
+            char *value = strchr(token, '=');
+
+            if (token[0] == '#')
+                break;
+            if (!value) {
+                valid = false;
+                break;
+            }
+            *value++ = '\0';
+
+            if (strcmp(token, "id") == 0) {
+                id = value;
+            }
+            else if (strcmp(token, "gpu") == 0) {
+                if (gpus.nr_cards >= MAX_NR_CARDS || get_vars(value, &gpus, 7) != 7) {
+                    valid = false;
+                    break;
+                }
+                gpus.cards[gpus.nr_cards++]->has_connected_outputs = -1;
+            }
+            else if (strcmp(token, "loaded") == 0) {
+                loaded = value;
+            }
+            else if (strcmp(token, "unloaded") == 0) {
+                unloaded = value;
+            }
+            else if (strcmp(token, "available") == 0) {
+                available = value;
+            }
+            else if (strcmp(token, "versioned") == 0) {
+                versioned = value;
+            }
+            else if (strcmp(token, "offloading") == 0) {
+                state.offloading = atoi(value) != 0;
+            }
+            else if (strcmp(token, "changed") == 0) {
+                state.has_changed = atoi(value) != 0;
+            }
+            else if (strcmp(token, "amdgpu_pro_px") == 0) {
+                amdgpu_pro_px = atoi(value) != 0;
+            }
+            else if (strcmp(token, "offload_layout") == 0) {
+                state.has_offload_layout = atoi(value) != 0;
+            }
+            else if (strcmp(token, "prime") == 0) {
+                state.prime_mode = prime_mode_from_string(value);
+            }
+            else {
+                valid = false;
+                break;
+            }
+        }
+
+        /* Skip blank lines and comments */
+        if (valid && !id && gpus.nr_cards == 0) {
+            free_devices(&gpus);
+            continue;
+        }
+
+        if (!valid) {
+            fprintf(output, "%s error=line %lu\n", id ? id : "-", nr_line);
+            free_devices(&gpus);
+            continue;
+        }
+
+        state.nvidia_loaded = is_in_list(loaded, "nvidia");
+        state.nvidia_unloaded = !state.nvidia_loaded && is_in_list(unloaded, "nvidia");
+        state.intel_loaded = is_in_list(loaded, "i915") || is_in_list(loaded, "i810");
+        state.amdgpu_loaded = is_in_list(loaded, "amdgpu");
+        state.nouveau_loaded = is_in_list(loaded, "nouveau");
+        state.nvidia_kmod_available = is_in_list(available, "nvidia");
+        state.amdgpu_is_pro = is_in_list(available, "amdgpu") && is_in_list(versioned, "amdgpu");
+        state.amdgpu_pro_px_installed = amdgpu_pro_px;
+
+        if (!decide(&gpus, &state, &decision, &discrete))
+            fprintf(output, "%s error=no-boot-vga\n", id ? id : "-");
+        else
+            fprintf(output, "%s action=%s prime_mode=%s offloading=%d discrete=%s\n",
+                    id ? id : "-", action_names[decision.action],
+                    prime_mode_to_string(decision.prime_mode), decision.offloading,
+                    decision.discrete[0] ? decision.discrete : "none");
+        free_devices(&gpus);
+    }
+}
+
+
+/* Print a string as a JSON string literal */
+static void print_json_string(FILE *file, const char *str)
+{
+    fputc('"', file);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            fprintf(file, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            fprintf(file, "\\u%04x", *str);
+        else
+            fputc(*str, file);
+    }
+    fputc('"', file);
+}
+
+
+/* Print the GPUs, the offloading flag, the PRIME settings and the last
+ * decision, as JSON or as "key: value" lines
+ */
+static void print_status(FILE *file, struct gpus *gpus, const struct decision *decision,
+                         bool has_decision, bool json, bool live)
+{
+    char bdf[32];
+    const char *settings = "unknown";
+    bool offloading_conf = access(OFFLOADING_CONF, F_OK) == 0;
+
+    /* Don't create the settings file if it's not there */
+    if (access(prime_settings, R_OK) == 0)
+        settings = prime_mode_to_string(get_prime_action(prime_settings));
+
+    if (!json) {
+        fprintf(file, "source: %s\n", live ? "live" : "cache");
+        for (int i = 0; i < gpus->nr_cards; i++) {
+            const struct device *dev = gpus->cards[i];
+            get_bdf(dev, bdf, sizeof(bdf));
+            fprintf(file, "gpu: %s %04x:%04x%s\n", bdf, dev->vendor_id, dev->device_id,
+                    dev->boot_vga ? " boot_vga" : "");
+        }
+        fprintf(file, "offloading: %s\n", offloading_conf ? "yes" : "no");
+        fprintf(file, "prime_settings: %s\n", settings);
+        if (has_decision) {
+            fprintf(file, "last_decision: %s\n", action_names[decision->action]);
+            fprintf(file, "last_decision_time: %lld\n", (long long)decision->timestamp);
+            fprintf(file, "prime_mode: %s\n", prime_mode_to_string(decision->prime_mode));
+            fprintf(file, "discrete: %s\n", decision->discrete[0] ? decision->discrete : "none");
+        }
+        return;
+    }
+
+    fprintf(file, "{\"source\": \"%s\", \"gpus\": [", live ? "live" : "cache");
+    for (int i = 0; i < gpus->nr_cards; i++) {
+        const struct device *dev = gpus->cards[i];
+
+        get_bdf(dev, bdf, sizeof(bdf));
+        fprintf(file, "%s{\"bdf\": \"%s\", \"vendor\": \"0x%04x\", \"device\": \"0x%04x\", "
+                      "\"boot_vga\": %s, \"numa_node\": %d, \"local_cpulist\": ",
+                i ? ", " : "", bdf, dev->vendor_id, dev->device_id,
+                dev->boot_vga ? "true" : "false", dev->numa_node);
+        print_json_string(file, dev->local_cpulist);
+        fprintf(file, ", \"link\": {\"speed\": %u, \"width\": %u, \"max_speed\": %u, "
+                      "\"max_width\": %u, \"degraded\": %s}, \"bars\": [",
+                dev->cur_link_speed, dev->cur_link_width,
+                dev->max_link_speed, dev->max_link_width,
+                dev->link_health ? "true" : "false");
+        for (size_t bar = 0; bar < NR_BARS; bar++)
+            fprintf(file, "%s%llu", bar ? ", " : "", dev->bar_size[bar]);
+        fprintf(file, "]}");
+    }
+    fprintf(file, "], \"offloading\": %s, \"prime_settings\": \"%s\", \"last_decision\": ",
+            offloading_conf ? "true" : "false", settings);
+    if (has_decision) {
+        fprintf(file, "{\"timestamp\": %lld, \"action\": \"%s\", \"prime_mode\": \"%s\", "
+                      "\"offloading\": %s, \"discrete\": ",
+                (long long)decision->timestamp, action_names[decision->action],
+                prime_mode_to_string(decision->prime_mode),
+                decision->offloading ? "true" : "false");
+        print_json_string(file, decision->discrete);
+        fprintf(file, "}");
+    }
+    else {
+        fprintf(file, "null");
+    }
+    fprintf(file, "}\n");
+}
+
+
+/* Add a display controller to the list of the cards.
+ * Return 1 if the list is full, 0 on success or if the device is skipped,
+ * and a negative error code on failure.
+ */
+static int add_display_device(struct gpus *gpus, const struct device *candidate)
+{
+    char reason[64];
+
+    log_msg(GPU_MANAGER_LOG_DEBUG, "Device ID: 0x%04X\n", candidate->device_id);
+    log_msg(GPU_MANAGER_LOG_DEBUG, "  Vendor ID: 0x%04X\n", candidate->vendor_id);
+    log_msg(GPU_MANAGER_LOG_DEBUG, "  Bus ID: \"%04X:%02X:%02X.%02X\"\n",
+            candidate->domain, candidate->bus, candidate->dev, candidate->func);
+    log_msg(GPU_MANAGER_LOG_DEBUG, "  Boot VGA: %s\n", candidate->boot_vga ? "yes" : "no");
+
+    if (get_device_passthrough_reason(candidate, reason, sizeof(reason))) {
+        log_msg(GPU_MANAGER_LOG_INFO, "The device is a pci passthrough (%s). Skipping...\n", reason);
+        if (gpus->nr_passthrough < MAX_NR_CARDS)
+            get_bdf(candidate, gpus->passthrough[gpus->nr_passthrough], sizeof(gpus->passthrough[0]));
+        gpus->nr_passthrough += 1;
+        return 0;
+    }
+
+    if (!is_device_bound_to_driver(candidate)) {
+        log_msg(GPU_MANAGER_LOG_INFO, "The device is not bound to any driver.\n");
+    }
+
+    /* We don't support more than MAX_NR_CARDS */
+    if (gpus->nr_cards >= MAX_NR_CARDS) {
+        log_msg(GPU_MANAGER_LOG_WARNING, "Warning: too many devices. "
+                            "Max supported %d. Ignoring the rest.\n",
+                            MAX_NR_CARDS);
+        return 1;
+    }
+
+    struct device *dev = new_device();
+    if (!dev)
+        return -ENOMEM;
+
+    *dev = *candidate;
+    dev->has_connected_outputs = -1;
+    get_device_topology(dev);
+    check_link_health(dev);
+
+    gpus->cards[gpus->nr_cards] = dev;
+    gpus->nr_cards += 1;
+
+    return 0;
+}
+
+
+/* Read a hexadecimal sysfs attribute of a PCI device, relative to the
+ * /sys/bus/pci/devices directory
+ */
+static bool read_pci_attribute_at(int dirfd, const char *name, const char *attribute,
+                                  unsigned int *value)
+{
+    char path[PATH_MAX];
+    char buf[32];
+    ssize_t length;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", name, attribute);
+    fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    length = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (length <= 0)
+        return false;
+    buf[length] = '\0';
+
+    return sscanf(buf, "%x", value) == 1;
+}
+
+
+/* Look for the display controllers by reading only the class of each
+ * PCI function from sysfs. Unlike libpciaccess, this doesn't read the
+ * config space of every device on the bus, which can take long on systems
+ * with many virtual functions.
+ */
+static int get_display_devices_from_sysfs(struct gpus *gpus)
+{
+    struct dirent **entries;
+    DIR *dfd;
+    int ret = 0;
+    int nr_entries;
+    char pci_dir[] = "/sys/bus/pci/devices";
+
+    if ((dfd = opendir(pci_dir)) == NULL) {
+        log_msg(GPU_MANAGER_LOG_ERR, "Error: can't open %s\n", pci_dir);
+        return -errno;
+    }
+
+    /* The directory isn't sorted. Go in the order of libpciaccess, as
+     * has_system_changed() compares the cards by index
+     */
+    nr_entries = scandir(pci_dir, &entries, NULL, alphasort);
+    if (nr_entries < 0) {
+        log_msg(GPU_MANAGER_LOG_ERR, "Error: can't read %s\n", pci_dir);
+        closedir(dfd);
+        return -errno;
+    }
+
+    for (int i = 0; i < nr_entries; i++) {
+        struct dirent *dp = entries[i];
+        struct device candidate = {0};
+        unsigned int device_class;
+        unsigned int value;
+
+        if (dp->d_name[0] == '.')
+            continue;
+
+        if (!read_pci_attribute_at(dirfd(dfd), dp->d_name, "class", &device_class) ||
+            ((device_class >> 16) & 0xFF) != PCI_CLASS_DISPLAY)
+            continue;
+
+        if (sscanf(dp->d_name, "%x:%x:%x.%x", &candidate.domain, &candidate.bus,
+                   &candidate.dev, &candidate.func) != 4)
+            continue;
+
+        if (!read_pci_attribute_at(dirfd(dfd), dp->d_name, "vendor", &value))
+            continue;
+        candidate.vendor_id = value;
+
+        if (!read_pci_attribute_at(dirfd(dfd), dp->d_name, "device", &value))
+            continue;
+        candidate.device_id = value;
+
+        /* Only VGA devices have a boot_vga attribute */
+        if (read_pci_attribute_at(dirfd(dfd), dp->d_name, "boot_vga", &value))
+            candidate.boot_vga = value;
+
+        ret = add_display_device(gpus, &candidate);
+        if (ret != 0)
+            break;
+    }
+    for (int i = 0; i < nr_entries; i++)
+        free(entries[i]);
+    free(entries);
+    closedir(dfd);
+
+    return ret < 0 ? ret : 0;
+}
+
+
+/* Scan the whole PCI bus with libpciaccess */
+static int get_display_devices_from_pciaccess(struct gpus *gpus)
+{
+    struct pci_device *info;
+    struct pci_device_iterator *iter;
+    int ret;
+
+    if (!load_pciaccess())
+        return -ENOSYS;
+
+    ret = pci_api.system_init();
+    if (ret != 0)
+        return -ret;
+
+    const struct pci_slot_match match = {
+        PCI_MATCH_ANY,
+        PCI_MATCH_ANY,
+        PCI_MATCH_ANY,
+        PCI_MATCH_ANY,
+        0,
+    };
+
+    iter = pci_api.slot_match_iterator_create(&match);
+    if (!iter) {
+        ret = -1;
+        goto out;
+    }
+
+    while ((info = pci_api.device_next(iter)) != NULL) {
+        if (is_display_controller(info)) {
+            struct device candidate = {
+                .boot_vga = pci_api.device_is_boot_vga(info),
+                .vendor_id = info->vendor_id,
+                .device_id = info->device_id,
+                .domain = info->domain,
+                .bus = info->bus,
+                .dev = info->dev,
+                .func = info->func,
+            };
+
+            ret = add_display_device(gpus, &candidate);
+            if (ret != 0)
+                break;
+        }
+    }
+
+out:
+    free(iter);
+    pci_api.system_cleanup();
+
+    return ret < 0 ? ret : 0;
+}
+
+
+static int get_current_devices(struct gpus *gpus)
+{
+    int ret;
+    bool has_amd = false;
+    bool has_intel = false;
+    bool has_nvidia = false;
+
+    /* Get the current system data */
+    begin_probe("pci");
+    if (full_pci_scan)
+        ret = get_display_devices_from_pciaccess(gpus);
+    else
+        ret = get_display_devices_from_sysfs(gpus);
+    end_probe();
+
+    if (ret != 0) {
+        free_devices(gpus);
+        return ret;
+    }
+
+    /* Before the slower probes, which the quirk may skip */
+    active_quirk = find_quirk(gpus);
+
+    /* Probe the drm cards only once for all the drivers. The outputs
+     * stay unknown if the quirk skips it
+     */
+    struct drm_cards drm_cards = {0};
+    if (active_quirk && active_quirk->skip_drm)
+        log_msg(GPU_MANAGER_LOG_INFO, "Skipping the DRM probe by quirk\n");
+    else {
+        begin_probe("drm");
+        probe_drm_cards(&drm_cards);
+        end_probe();
+    }
+
+    int amdgpu_has_outputs = has_driver_connected_outputs(&drm_cards, "amdgpu");
+    int radeon_has_outputs = has_driver_connected_outputs(&drm_cards, "radeon");
+    int nouveau_has_outputs = has_driver_connected_outputs(&drm_cards, "nouveau");
+    int intel_has_outputs = has_driver_connected_outputs(&drm_cards, "i915");
+
+    for (int i = 0; i < gpus->nr_cards; i++) {
+        struct device *dev = gpus->cards[i];
+
+        if (dev->vendor_id == AMD) {
+            int has_outputs = (radeon_has_outputs != -1) ? radeon_has_outputs : amdgpu_has_outputs;
+            dev->has_connected_outputs = has_outputs;
+            has_amd = true;
+        }
+        else if (dev->vendor_id == INTEL) {
+            dev->has_connected_outputs = intel_has_outputs;
+            has_intel = true;
+        }
+        else if (dev->vendor_id == NVIDIA) {
+            dev->has_connected_outputs = nouveau_has_outputs;
+            has_nvidia = true;
+        }
+    }
+
+    log_msg(GPU_MANAGER_LOG_INFO, "Cards detected: %d\n", gpus->nr_cards);
+    log_msg(GPU_MANAGER_LOG_INFO, "  AMD: %s\n", (has_amd ? "yes" : "no"));
+    log_msg(GPU_MANAGER_LOG_INFO, "  Intel: %s\n", (has_intel ? "yes" : "no"));
+    log_msg(GPU_MANAGER_LOG_INFO, "  NVIDIA: %s\n", (has_nvidia ? "yes" : "no"));
+
+    log_msg(GPU_MANAGER_LOG_INFO, "Passthrough devices skipped: %d\n", gpus->nr_passthrough);
+    for (int i = 0; i < gpus->nr_passthrough && i < MAX_NR_CARDS; i++)
+        log_msg(GPU_MANAGER_LOG_INFO, "  %s\n", gpus->passthrough[i]);
+
+    return 0;
+}
+
+/* Apply the decision of the last run, if any, instead of the one we
+ * couldn't take, on the devices which it was taken on.
+ */
+static void apply_last_decision(void)
+{
+    struct decision decision;
+    struct device wanted = {0};
+    struct device none = {0};
+    struct device *discrete = NULL;
+    struct gpus gpus = {0};
+
+    if (!read_decision_from_file(last_decision_file, &decision)) {
+        log_msg(GPU_MANAGER_LOG_WARNING, "Watchdog: no previous decision to fall back to\n");
+        return;
+    }
+
+    log_msg(GPU_MANAGER_LOG_WARNING, "Watchdog: falling back to the last decision: %s\n",
+            action_names[decision.action]);
+
+    if (decision.action == ACTION_PRIME) {
+        if (!get_device_from_bdf(decision.discrete, &wanted)) {
+            log_msg(GPU_MANAGER_LOG_WARNING, "Watchdog: invalid discrete GPU %s\n", decision.discrete);
+            return;
+        }
+        /* The devices of the last boot */
+        if (!read_data_from_file(last_boot_file, &gpus)) {
+            free_devices(&gpus);
+            return;
+        }
+        for (int i = 0; i < gpus.nr_cards; i++) {
+            if (gpus.cards[i]->domain == wanted.domain && gpus.cards[i]->bus == wanted.bus &&
+                gpus.cards[i]->dev == wanted.dev && gpus.cards[i]->func == wanted.func)
+                discrete = gpus.cards[i];
+        }
+        if (!discrete) {
+            log_msg(GPU_MANAGER_LOG_WARNING, "Watchdog: %s isn't in %s\n", decision.discrete, last_boot_file);
+            free_devices(&gpus);
+            return;
+        }
+    }
+
+    apply_decision(&gpus, discrete ? discrete : &none, &decision);
+    free_devices(&gpus);
+}
+
+
+/* The nvidia modules, loaded while the hardware is being probed when
+ * the last decision suggests that they will be needed again
+ */
+static struct {
+    pthread_t thread;
+    bool started;
+    /* The state of the module before we loaded it */
+    bool was_loaded;
+    bool was_unloaded;
+    bool status;
+    long long start;
+    long long end;
+} speculation;
+
+
+/* Whether the last decision is likely to be taken again: PRIME with the
+ * nvidia driver, the same PRIME settings, and an NVIDIA GPU still where
+ * the discrete GPU was
+ */
+static bool predicts_nvidia_load(void)
+{
+    struct decision decision;
+    char path[PATH_MAX];
+    char vendor_id[16];
+
+    if (!read_decision_from_file(last_decision_file, &decision))
+        return false;
+    if (decision.action != ACTION_PRIME || decision.prime_mode == OFF)
+        return false;
+
+    if (!prime_mode_override && !(active_quirk && active_quirk->prime_mode >= 0) &&
+        !exists_not_empty(prime_settings))
+        return false;
+    if (get_prime_action(prime_settings) != decision.prime_mode)
+        return false;
+
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/vendor", decision.discrete);
+    if (!read_sysfs_attribute(path, vendor_id, sizeof(vendor_id)) ||
+        strtoul(vendor_id, NULL, 16) != NVIDIA)
+        return false;
+
+    return !is_module_blacklisted("nvidia");
+}
+
+
+static void *run_speculative_load(void *data)
+{
+    (void)data;
+
+    speculation.status = load_module("nvidia");
+    speculation.end = get_monotonic_ms();
+
+    return NULL;
+}
+
+
+/* Start loading nvidia in the background if the last decision predicts
+ * that we need it, so that its initialisation overlaps the probing
+ */
+static void start_speculative_load(void)
+{
+    speculation.started = false;
+
+    if (!speculative_load || dry_run || fake_lspci_file || !predicts_nvidia_load())
+        return;
+
+    speculation.was_loaded = is_module_loaded("nvidia");
+    speculation.was_unloaded = speculation.was_loaded ? false : has_unloaded_module("nvidia");
+    if (speculation.was_loaded)
+        return;
+
+    log_msg(GPU_MANAGER_LOG_INFO, "The last decision predicts nvidia, loading it ahead of the decision\n");
+    speculation.start = get_monotonic_ms();
+    if (pthread_create(&speculation.thread, NULL, run_speculative_load, NULL) != 0) {
+        log_msg(GPU_MANAGER_LOG_ERR, "Error: can't start the speculative load\n");
+        return;
+    }
+    speculation.started = true;
+}
+
+
+/* Wait for the speculative load, and undo it if the decision doesn't
+ * need nvidia after all
+ */
+static void finish_speculative_load(const struct gpu_manager_decision *decision, bool decided)
+{
+    if (!speculation.started)
+        return;
+
+    pthread_join(speculation.thread, NULL);
+    speculation.started = false;
+
+    log_msg(GPU_MANAGER_LOG_INFO, "Speculative load of nvidia %s after %lld ms\n",
+            speculation.status ? "finished" : "failed",
+            speculation.end - speculation.start);
+
+    if (!speculation.status)
+        return;
+    if (decided && decision->action == GPU_MANAGER_ACTION_PRIME &&
+        decision->prime_mode != GPU_MANAGER_PRIME_OFF)
+        return;
+
+    log_msg(GPU_MANAGER_LOG_INFO, "The decision doesn't need nvidia, unloading it\n");
+    unload_nvidia();
+}
+
+
+/* The settings of a context, which enter_context() loads in the globals */
+struct gpu_manager_context {
+    char *last_boot_file;
+    char *new_boot_file;
+    char *fake_lspci_file;
+    char *fake_modules_path;
+    char *gpu_detection_path;
+    char *prime_settings;
+    char *dmi_product_name_path;
+    char *dmi_product_version_path;
+    char *amdgpu_pro_px_file;
+    char *modprobe_d_path;
+    char *xorg_conf_d_path;
+    char *last_decision_file;
+    char *metrics_textfile;
+    char *discrete_bdf;
+    char *journal_file;
+    char *cmdline_file;
+    char *prime_mode;
+    char *policy_file;
+    char *quirks_file;
+    int dry_run;
+    int fake_offloading;
+    int fake_module_available;
+    int fake_module_versioned;
+    int no_wake;
+    int full_pci_scan;
+    int pm_siblings;
+    int autosuspend_delay_ms;
+    int pm_verify_timeout_ms;
+    int deadline_ms;
+    int probe_budget_ms;
+    int speculative_load;
+    int watch_debounce_ms;
+
+    /* The log goes through a FILE, which hands whole lines to log_func */
+    FILE *log;
+    gpu_manager_log_func log_func;
+    void *log_data;
+    char line[1024];
+    size_t line_len;
+    enum gpu_manager_log_level line_level;
+
+    /* The devices from the last inventory. Those after the first
+     * nr_probed ones were added by the decision, from the GPU detection
+     * files.
+     */
+    struct gpus devices;
+    int nr_probed;
+    bool probed;
+    /* The quirk matched by the last inventory, if has_quirk */
+    struct quirk quirk;
+    bool has_quirk;
+};
+
+typedef enum {
+    OPTION_STRING,
+    OPTION_NUMBER,
+    /* Doesn't take a value, sets the number to flag_value */
+    OPTION_FLAG,
+} option_type;
+
+#define CONTEXT_FIELD(field) offsetof(struct gpu_manager_context, field)
+
+static const struct context_option {
+    const char *name;
+    option_type type;
+    size_t offset;
+    int flag_value;
+} context_options[] = {
+    {"amdgpu-pro-px-file", OPTION_STRING, CONTEXT_FIELD(amdgpu_pro_px_file), 0},
+    {"autosuspend-delay-ms", OPTION_NUMBER, CONTEXT_FIELD(autosuspend_delay_ms), 0},
+    {"deadline-ms", OPTION_NUMBER, CONTEXT_FIELD(deadline_ms), 0},
+    {"discrete-bdf", OPTION_STRING, CONTEXT_FIELD(discrete_bdf), 0},
+    {"dmi-product-name-path", OPTION_STRING, CONTEXT_FIELD(dmi_product_name_path), 0},
+    {"dmi-product-version-path", OPTION_STRING, CONTEXT_FIELD(dmi_product_version_path), 0},
+    {"dry-run", OPTION_FLAG, CONTEXT_FIELD(dry_run), 1},
+    {"fake-cmdline", OPTION_STRING, CONTEXT_FIELD(cmdline_file), 0},
+    {"fake-lspci", OPTION_STRING, CONTEXT_FIELD(fake_lspci_file), 0},
+    {"fake-module-is-available", OPTION_FLAG, CONTEXT_FIELD(fake_module_available), 1},
+    {"fake-module-is-not-available", OPTION_FLAG, CONTEXT_FIELD(fake_module_available), 0},
+    {"fake-module-is-versioned", OPTION_FLAG, CONTEXT_FIELD(fake_module_versioned), 1},
+    {"fake-modules-path", OPTION_STRING, CONTEXT_FIELD(fake_modules_path), 0},
+    {"fake-no-requires-offloading", OPTION_FLAG, CONTEXT_FIELD(fake_offloading), 0},
+    {"fake-requires-offloading", OPTION_FLAG, CONTEXT_FIELD(fake_offloading), 1},
+    {"full-pci-scan", OPTION_FLAG, CONTEXT_FIELD(full_pci_scan), 1},
+    {"gpu-detection-path", OPTION_STRING, CONTEXT_FIELD(gpu_detection_path), 0},
+    {"journal-file", OPTION_STRING, CONTEXT_FIELD(journal_file), 0},
+    {"last-boot-file", OPTION_STRING, CONTEXT_FIELD(last_boot_file), 0},
+    {"last-decision-file", OPTION_STRING, CONTEXT_FIELD(last_decision_file), 0},
+    {"metrics-textfile", OPTION_STRING, CONTEXT_FIELD(metrics_textfile), 0},
+    {"modprobe-d-path", OPTION_STRING, CONTEXT_FIELD(modprobe_d_path), 0},
+    {"new-boot-file", OPTION_STRING, CONTEXT_FIELD(new_boot_file), 0},
+    {"no-pm-siblings", OPTION_FLAG, CONTEXT_FIELD(pm_siblings), 0},
+    {"no-speculative-load", OPTION_FLAG, CONTEXT_FIELD(speculative_load), 0},
+    {"no-wake", OPTION_FLAG, CONTEXT_FIELD(no_wake), 1},
+    {"pm-siblings", OPTION_FLAG, CONTEXT_FIELD(pm_siblings), 1},
+    {"pm-verify-timeout-ms", OPTION_NUMBER, CONTEXT_FIELD(pm_verify_timeout_ms), 0},
+    {"policy-file", OPTION_STRING, CONTEXT_FIELD(policy_file), 0},
+    {"prime-mode", OPTION_STRING, CONTEXT_FIELD(prime_mode), 0},
+    {"prime-settings", OPTION_STRING, CONTEXT_FIELD(prime_settings), 0},
+    {"probe-budget-ms", OPTION_NUMBER, CONTEXT_FIELD(probe_budget_ms), 0},
+    {"quirks-file", OPTION_STRING, CONTEXT_FIELD(quirks_file), 0},
+    {"speculative-load", OPTION_FLAG, CONTEXT_FIELD(speculative_load), 1},
+    {"wake", OPTION_FLAG, CONTEXT_FIELD(no_wake), 0},
+    {"watch-debounce-ms", OPTION_NUMBER, CONTEXT_FIELD(watch_debounce_ms), 0},
+    {"xorg-conf-d-path", OPTION_STRING, CONTEXT_FIELD(xorg_conf_d_path), 0},
+};
+
+/* The public enums mirror the internal ones */
+_Static_assert((int)GPU_MANAGER_ACTION_REMOVE_OFFLOAD == (int)ACTION_REMOVE_OFFLOAD,
+               "gpu_manager_action doesn't match decision_action");
+_Static_assert((int)GPU_MANAGER_PRIME_ON == (int)ON &&
+               (int)GPU_MANAGER_PRIME_OFF == (int)OFF &&
+               (int)GPU_MANAGER_PRIME_ON_DEMAND == (int)ONDEMAND,
+               "gpu_manager_prime_mode doesn't match prime_mode_settings");
+
+
+/* Hand a line over to the logger, with the level which log_msg() put
+ * before it
+ */
+static void hand_over_line(struct gpu_manager_context *ctx)
+{
+    const char *line = ctx->line;
+
+    ctx->line[ctx->line_len] = '\0';
+    if (line[0] == '<' && isdigit((unsigned char)line[1]) && line[2] == '>') {
+        ctx->line_level = (enum gpu_manager_log_level)(line[1] - '0');
+        line += 3;
+    }
+    if (ctx->log_func)
+        ctx->log_func(ctx->line_level, line, ctx->log_data);
+    ctx->line_len = 0;
+}
+
+
+static ssize_t write_log(void *cookie, const char *buf, size_t size)
+{
+    struct gpu_manager_context *ctx = cookie;
+
+    for (size_t i = 0; i < size; i++) {
+        if (buf[i] != '\n' && ctx->line_len < sizeof(ctx->line) - 1) {
+            ctx->line[ctx->line_len++] = buf[i];
+            continue;
+        }
+        /* Lines which are too long are split, and keep their level */
+        hand_over_line(ctx);
+        if (buf[i] == '\n')
+            ctx->line_level = GPU_MANAGER_LOG_INFO;
+        else
+            ctx->line[ctx->line_len++] = buf[i];
+    }
+    return size;
+}
+
+
+struct gpu_manager_context *gpu_manager_context_new(void)
+{
+    struct gpu_manager_context *ctx = NULL;
+    cookie_io_functions_t log_functions = { .write = write_log };
+
+    ctx = calloc(1, sizeof(*ctx));
+    if (!ctx)
+        return NULL;
+
+    ctx->last_boot_file = strdup(LAST_BOOT);
+    ctx->gpu_detection_path = strdup("/run");
+    ctx->prime_settings = strdup("/etc/prime-discrete");
+    ctx->dmi_product_name_path = strdup("/sys/class/dmi/id/product_name");
+    ctx->dmi_product_version_path = strdup("/sys/class/dmi/id/product_version");
+    ctx->amdgpu_pro_px_file = strdup(AMDGPU_PRO_PX);
+    ctx->modprobe_d_path = strdup("/etc/modprobe.d");
+    ctx->xorg_conf_d_path = strdup("/usr/share/X11/xorg.conf.d");
+    ctx->last_decision_file = strdup(LAST_DECISION);
+    ctx->journal_file = strdup(JOURNAL);
+    ctx->cmdline_file = strdup("/proc/cmdline");
+    ctx->policy_file = strdup("/etc/gpu-manager/policy");
+    ctx->quirks_file = strdup("/etc/gpu-manager/quirks");
+    ctx->no_wake = 1;
+    ctx->pm_siblings = 1;
+    ctx->autosuspend_delay_ms = -1;
+    /* Off: the dGPU rarely suspends right after nvidia is loaded, and
+     * waiting for it would hold up the display manager
+     */
+    ctx->pm_verify_timeout_ms = -1;
+    ctx->deadline_ms = 5000;
+    ctx->probe_budget_ms = 2000;
+    ctx->watch_debounce_ms = 250;
+
+    ctx->line_level = GPU_MANAGER_LOG_INFO;
+    ctx->log = fopencookie(ctx, "w", log_functions);
+    if (ctx->log)
+        setvbuf(ctx->log, NULL, _IOLBF, 0);
+
+    if (!ctx->log || !ctx->last_boot_file || !ctx->gpu_detection_path ||
+        !ctx->prime_settings || !ctx->dmi_product_name_path ||
+        !ctx->dmi_product_version_path || !ctx->amdgpu_pro_px_file ||
+        !ctx->modprobe_d_path || !ctx->xorg_conf_d_path ||
+        !ctx->last_decision_file || !ctx->journal_file || !ctx->cmdline_file ||
+        !ctx->policy_file || !ctx->quirks_file) {
+        gpu_manager_context_free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+
+void gpu_manager_context_free(struct gpu_manager_context *ctx)
+{
+    if (!ctx)
+        return;
+
+    if (ctx->log) {
+        /* Hand over what is left of the last line */
+        fflush(ctx->log);
+        if (ctx->line_len > 0)
+            write_log(ctx, "\n", 1);
+        fclose(ctx->log);
+    }
+    if (log_handle == ctx->log)
+        log_handle = NULL;
+
+    for (size_t i = 0; i < sizeof(context_options) / sizeof(context_options[0]); i++) {
+        if (context_options[i].type == OPTION_STRING) {
+            char **string = (char **)((char *)ctx + context_options[i].offset);
+            free(*string);
+        }
+    }
+
+    free_devices(&ctx->devices);
+    free(ctx);
+}
+
+
+int gpu_manager_context_set_option(struct gpu_manager_context *ctx,
+                                   const char *name, const char *value)
+{
+    for (size_t i = 0; i < sizeof(context_options) / sizeof(context_options[0]); i++) {
+        const struct context_option *option = &context_options[i];
+        void *field = (char *)ctx + option->offset;
+        char *end = NULL;
+        long number;
+
+        if (strcmp(option->name, name) != 0)
+            continue;
+
+        switch (option->type) {
+        case OPTION_STRING: {
+            char *copy;
+
+            if (!value)
+                return -EINVAL;
+            if (option->offset == CONTEXT_FIELD(prime_mode) &&
+                strcmp(value, "on") != 0 && strcmp(value, "off") != 0 &&
+                strcmp(value, "on-demand") != 0)
+                return -EINVAL;
+            copy = strdup(value);
+            if (!copy)
+                return -ENOMEM;
+            free(*(char **)field);
+            *(char **)field = copy;
+            return 0;
+        }
+        case OPTION_NUMBER:
+            if (!value)
+                return -EINVAL;
+            errno = 0;
+            number = strtol(value, &end, 10);
+            if (errno || end == value || *end || number < INT_MIN || number > INT_MAX)
+                return -EINVAL;
+            *(int *)field = (int)number;
+            return 0;
+        case OPTION_FLAG:
+            if (!value || strcmp(value, "1") == 0 || strcmp(value, "y") == 0 ||
+                strcmp(value, "yes") == 0 || strcmp(value, "on") == 0)
+                *(int *)field = option->flag_value;
+            else if (strcmp(value, "0") == 0 || strcmp(value, "n") == 0 ||
+                     strcmp(value, "no") == 0 || strcmp(value, "off") == 0)
+                *(int *)field = !option->flag_value;
+            else
+                return -EINVAL;
+            return 0;
+        }
+    }
+
+    return -EINVAL;
+}
+
+
+/* The settings which gpumanager.* boot parameters can override. Paths
+ * and the fake-* and dry-run test settings are left out.
+ */
+static const struct {
+    const char *alias;
+    const char *name;
+} cmdline_options[] = {
+    {"autosuspend-delay-ms", "autosuspend-delay-ms"},
+    {"deadline-ms", "deadline-ms"},
+    {"discrete-bdf", "discrete-bdf"},
+    {"full-pci-scan", "full-pci-scan"},
+    {"mode", "prime-mode"},
+    {"no-pm-siblings", "no-pm-siblings"},
+    {"no-speculative-load", "no-speculative-load"},
+    {"no-wake", "no-wake"},
+    {"pm-siblings", "pm-siblings"},
+    {"pm-verify-timeout-ms", "pm-verify-timeout-ms"},
+    {"prime-mode", "prime-mode"},
+    {"probe-budget-ms", "probe-budget-ms"},
+    {"speculative-load", "speculative-load"},
+    {"wake", "wake"},
+};
+
+
+/* Compare option names, ignoring dashes and underscores, so that
+ * "gpumanager.deadline_ms" and "gpumanager.nowake" find "deadline-ms"
+ * and "no-wake"
+ */
+static bool is_same_option_name(const char *a, const char *b)
+{
+    for (;;) {
+        while (*a == '-' || *a == '_')
+            a++;
+        while (*b == '-' || *b == '_')
+            b++;
+        if (*a != *b)
+            return false;
+        if (!*a)
+            return true;
+        a++;
+        b++;
+    }
+}
+
+
+/* Let "gpumanager.<option>[=<value>]" boot parameters override the
+ * settings of the context. Return the number of settings changed
+ */
+static int apply_cmdline_overrides(struct gpu_manager_context *ctx)
+{
+    static const char prefix[] = "gpumanager.";
+    int changed = 0;
+
+    load_cmdline(ctx->cmdline_file);
+
+    for (size_t i = 0; i < cmdline.nr_params; i++) {
+        const struct cmdline_param *param = &cmdline.params[i];
+        const char *key = param->key + strlen(prefix);
+        const char *name = NULL;
+
+        if (strncmp(param->key, prefix, strlen(prefix)) != 0)
+            continue;
+
+        for (size_t j = 0; j < sizeof(cmdline_options) / sizeof(cmdline_options[0]); j++) {
+            if (is_same_option_name(key, cmdline_options[j].alias))
+                name = cmdline_options[j].name;
+        }
+
+        if (!name || gpu_manager_context_set_option(ctx, name, param->value) < 0) {
+            log_msg(GPU_MANAGER_LOG_WARNING, "Ignoring invalid boot parameter \"%s%s%s\"\n",
+                    param->key, param->value ? "=" : "", param->value ? param->value : "");
+            continue;
+        }
+        log_msg(GPU_MANAGER_LOG_INFO, "Boot parameter overrides %s: %s\n", name,
+                param->value ? param->value : "(set)");
+        changed++;
+    }
+
+    return changed;
+}
+
+
+void gpu_manager_context_set_logger(struct gpu_manager_context *ctx,
+                                    gpu_manager_log_func func, void *data)
+{
+    fflush(ctx->log);
+    ctx->log_func = func;
+    ctx->log_data = data;
+}
+
+
+void gpu_manager_context_set_dry_run(struct gpu_manager_context *ctx, bool dry_run_enabled)
+{
+    ctx->dry_run = dry_run_enabled;
+}
+
+
+/* Make the settings of the context those of the code above. This is
+ * why the API isn't reentrant, see gpu-manager.h
+ */
+static void enter_context(struct gpu_manager_context *ctx)
+{
+    last_boot_file = ctx->last_boot_file;
+    new_boot_file = ctx->new_boot_file ? ctx->new_boot_file : ctx->last_boot_file;
+    fake_lspci_file = ctx->fake_lspci_file;
+    fake_modules_path = ctx->fake_modules_path;
+    gpu_detection_path = ctx->gpu_detection_path;
+    prime_settings = ctx->prime_settings;
+    dmi_product_name_path = ctx->dmi_product_name_path;
+    dmi_product_version_path = ctx->dmi_product_version_path;
+    amdgpu_pro_px_file = ctx->amdgpu_pro_px_file;
+    modprobe_d_path = ctx->modprobe_d_path;
+    xorg_conf_d_path = ctx->xorg_conf_d_path;
+    last_decision_file = ctx->last_decision_file;
+    metrics_textfile = ctx->metrics_textfile;
+    discrete_bdf = ctx->discrete_bdf;
+    journal_file = ctx->journal_file;
+    cmdline_file = ctx->cmdline_file;
+    prime_mode_override = ctx->prime_mode;
+    policy_file = ctx->policy_file;
+    quirks_file = ctx->quirks_file;
+    dry_run = ctx->dry_run;
+    fake_offloading = ctx->fake_offloading;
+    fake_module_available = ctx->fake_module_available;
+    fake_module_versioned = ctx->fake_module_versioned;
+    no_wake = ctx->no_wake;
+    full_pci_scan = ctx->full_pci_scan;
+    pm_siblings = ctx->pm_siblings;
+    autosuspend_delay_ms = ctx->autosuspend_delay_ms;
+    pm_verify_timeout_ms = ctx->pm_verify_timeout_ms;
+    deadline_ms = ctx->deadline_ms;
+    probe_budget_ms = ctx->probe_budget_ms;
+    speculative_load = ctx->speculative_load;
+    watch_debounce_ms = ctx->watch_debounce_ms;
+    active_quirk = ctx->has_quirk ? &ctx->quirk : NULL;
+    log_handle = ctx->log;
+}
+
+
+static void log_settings(void)
+{
+    log_msg(GPU_MANAGER_LOG_DEBUG, "last_boot_file: %s\n", last_boot_file);
+    log_msg(GPU_MANAGER_LOG_DEBUG, "new_boot_file: %s\n", new_boot_file);
+    if (fake_lspci_file)
+        log_msg(GPU_MANAGER_LOG_DEBUG, "fake_lspci_file: %s\n", fake_lspci_file);
+    log_msg(GPU_MANAGER_LOG_DEBUG, "prime_settings file: %s\n", prime_settings);
+    log_msg(GPU_MANAGER_LOG_DEBUG, "dmi_product_name_path file: %s\n", dmi_product_name_path);
+    log_msg(GPU_MANAGER_LOG_DEBUG, "dmi_product_version_path file: %s\n", dmi_product_version_path);
+    log_msg(GPU_MANAGER_LOG_DEBUG, "amdgpu_pro_px_file file: %s\n", amdgpu_pro_px_file);
+    log_msg(GPU_MANAGER_LOG_DEBUG, "modprobe_d_path file: %s\n", modprobe_d_path);
+    log_msg(GPU_MANAGER_LOG_DEBUG, "xorg_conf_d_path file: %s\n", xorg_conf_d_path);
+    if (fake_modules_path)
+        log_msg(GPU_MANAGER_LOG_DEBUG, "fake_modules_path file: %s\n", fake_modules_path);
+    log_msg(GPU_MANAGER_LOG_DEBUG, "last_decision_file: %s\n", last_decision_file);
+    if (metrics_textfile)
+        log_msg(GPU_MANAGER_LOG_DEBUG, "metrics_textfile: %s\n", metrics_textfile);
+    log_msg(GPU_MANAGER_LOG_DEBUG, "journal_file: %s\n", journal_file);
+    log_msg(GPU_MANAGER_LOG_DEBUG, "policy_file: %s\n", policy_file);
+    log_msg(GPU_MANAGER_LOG_DEBUG, "quirks_file: %s\n", quirks_file);
+    if (discrete_bdf)
+        log_msg(GPU_MANAGER_LOG_DEBUG, "discrete_bdf: %s\n", discrete_bdf);
+    if (prime_mode_override)
+        log_msg(GPU_MANAGER_LOG_INFO, "Forced PRIME mode: %s\n", prime_mode_override);
+
+    log_msg(GPU_MANAGER_LOG_DEBUG, "No-wake detection: %s\n", no_wake ? "yes" : "no");
+    log_msg(GPU_MANAGER_LOG_DEBUG, "Speculative nvidia load: %s\n", speculative_load ? "yes" : "no");
+    log_msg(GPU_MANAGER_LOG_DEBUG, "PCI enumeration: %s\n", full_pci_scan ? "full scan" : "display class only");
+
+    log_msg(GPU_MANAGER_LOG_DEBUG, "Power policy: siblings %s, autosuspend delay %d ms, "
+                        "verification timeout %d ms\n",
+            pm_siblings ? "included" : "excluded",
+            autosuspend_delay_ms, pm_verify_timeout_ms);
+
+    log_msg(GPU_MANAGER_LOG_DEBUG, "Starting the watchdog: deadline %d ms, probe budget %d ms\n",
+            deadline_ms, probe_budget_ms);
+}
+
+
+int gpu_manager_inventory(struct gpu_manager_context *ctx, bool refresh_devices)
+{
+    int status;
+
+    enter_context(ctx);
+
+    if (ctx->probed && !refresh_devices)
+        return ctx->devices.nr_cards;
+
+    free_devices(&ctx->devices);
+    ctx->probed = false;
+
+    if (fake_lspci_file) {
+        /* Get the current system data from a file */
+        if (!read_data_from_file(fake_lspci_file, &ctx->devices)) {
+            log_msg(GPU_MANAGER_LOG_ERR, "Error: can't read %s\n", fake_lspci_file);
+            return -EIO;
+        }
+        /* Set data in the devices structs */
+        for (int i = 0; i < ctx->devices.nr_cards; i++) {
+            /* Set unavailable fake outputs */
+            ctx->devices.cards[i]->has_connected_outputs = -1;
+        }
+        active_quirk = find_quirk(&ctx->devices);
+    }
+    else {
+        status = get_current_devices(&ctx->devices);
+        if (status != 0)
+            return status < 0 ? status : -EIO;
+    }
+
+    /* Another context may read a different quirks file */
+    ctx->has_quirk = active_quirk != NULL;
+    if (active_quirk)
+        ctx->quirk = *active_quirk;
+    active_quirk = ctx->has_quirk ? &ctx->quirk : NULL;
+    ctx->probed = true;
+    ctx->nr_probed = ctx->devices.nr_cards;
+    return ctx->devices.nr_cards;
+}
+
+
+int gpu_manager_get_gpu(struct gpu_manager_context *ctx, int index,
+                        struct gpu_manager_gpu *gpu)
+{
+    const struct device *dev;
+
+    if (index < 0 || index >= ctx->devices.nr_cards)
+        return -EINVAL;
+
+    dev = ctx->devices.cards[index];
+    memset(gpu, 0, sizeof(*gpu));
+    gpu->vendor_id = dev->vendor_id;
+    gpu->device_id = dev->device_id;
+    gpu->domain = dev->domain;
+    gpu->bus = dev->bus;
+    gpu->dev = dev->dev;
+    gpu->func = dev->func;
+    gpu->boot_vga = dev->boot_vga;
+    gpu->numa_node = dev->numa_node;
+    gpu->cur_link_speed = dev->cur_link_speed;
+    gpu->cur_link_width = dev->cur_link_width;
+    gpu->max_link_speed = dev->max_link_speed;
+    gpu->max_link_width = dev->max_link_width;
+    gpu->link_degraded = dev->link_health != 0;
+    return 0;
+}
+
+
+static void to_public_decision(const struct decision *decision,
+                               struct gpu_manager_decision *public_decision)
+{
+    memset(public_decision, 0, sizeof(*public_decision));
+    public_decision->timestamp = decision->timestamp;
+    public_decision->action = (enum gpu_manager_action)decision->action;
+    public_decision->prime_mode = (enum gpu_manager_prime_mode)decision->prime_mode;
+    public_decision->offloading = decision->offloading;
+    snprintf(public_decision->discrete, sizeof(public_decision->discrete), "%s",
+             decision->discrete);
+}
+
+
+static void from_public_decision(const struct gpu_manager_decision *public_decision,
+                                 struct decision *decision)
+{
+    memset(decision, 0, sizeof(*decision));
+    decision->timestamp = public_decision->timestamp;
+    decision->action = (decision_action)public_decision->action;
+    decision->prime_mode = (prime_mode_settings)public_decision->prime_mode;
+    decision->offloading = public_decision->offloading;
+    snprintf(decision->discrete, sizeof(decision->discrete), "%s", public_decision->discrete);
+}
+
+
+int gpu_manager_decide(struct gpu_manager_context *ctx,
+                       struct gpu_manager_decision *public_decision)
+{
+    bool nvidia_blacklisted = false;
+    bool radeon_loaded = false;
+    bool radeon_blacklisted = false;
+    bool amdgpu_blacklisted = false;
+    bool nouveau_blacklisted = false;
+    bool amdgpu_kmod_available = false;
+    bool amdgpu_versioned = false;
+    struct system_state state = {0};
+    struct decision decision = {0};
+    struct device *discrete_device = NULL;
+    struct gpus old_devices = {0};
+    int status;
+
+    status = gpu_manager_inventory(ctx, false);
+    if (status < 0)
+        return status;
+    load_gpu_policies(policy_file);
+
+    /* Forget the cards added by an earlier decision */
+    while (ctx->devices.nr_cards > ctx->nr_probed) {
+        ctx->devices.nr_cards--;
+        free(ctx->devices.cards[ctx->devices.nr_cards]);
+        ctx->devices.cards[ctx->devices.nr_cards] = NULL;
+    }
+
+    begin_probe("modules");
+    if (speculation.started) {
+        /* Decide on the state from before the speculative load */
+        state.nvidia_loaded = speculation.was_loaded;
+        state.nvidia_unloaded = speculation.was_unloaded;
+    }
+    else {
+        state.nvidia_loaded = is_module_loaded("nvidia");
+        state.nvidia_unloaded = state.nvidia_loaded ? false : has_unloaded_module("nvidia");
+    }
+    nvidia_blacklisted = is_module_blacklisted("nvidia");
+    state.intel_loaded = is_module_loaded("i915") || is_module_loaded("i810");
+    radeon_loaded = is_module_loaded("radeon");
+    radeon_blacklisted = is_module_blacklisted("radeon");
+    state.amdgpu_loaded = is_module_loaded("amdgpu");
+    amdgpu_blacklisted = is_module_blacklisted("amdgpu");
+    amdgpu_versioned = is_module_versioned("amdgpu");
+    state.amdgpu_pro_px_installed = exists_not_empty(amdgpu_pro_px_file);
+    state.nouveau_loaded = is_module_loaded("nouveau");
+    nouveau_blacklisted = is_module_blacklisted("nouveau");
+    end_probe();
+
+    if (fake_lspci_file) {
+        state.nvidia_kmod_available = fake_module_available;
+        amdgpu_kmod_available = fake_module_available;
+        amdgpu_versioned = fake_module_versioned ? true : false;
+    }
+    else {
+        begin_probe("kmod");
+        state.nvidia_kmod_available = is_module_available("nvidia");
+        amdgpu_kmod_available = is_module_available("amdgpu");
+        end_probe();
+    }
+
+    state.amdgpu_is_pro = amdgpu_kmod_available && amdgpu_versioned;
+
+    log_msg(GPU_MANAGER_LOG_DEBUG, "Is nvidia loaded? %s\n", (state.nvidia_loaded ? "yes" : "no"));
+    log_msg(GPU_MANAGER_LOG_DEBUG, "Was nvidia unloaded? %s\n", (state.nvidia_unloaded ? "yes" : "no"));
+    log_msg(GPU_MANAGER_LOG_DEBUG, "Is nvidia blacklisted? %s\n", (nvidia_blacklisted ? "yes" : "no"));
+    log_msg(GPU_MANAGER_LOG_DEBUG, "Is intel loaded? %s\n", (state.intel_loaded ? "yes" : "no"));
+    log_msg(GPU_MANAGER_LOG_DEBUG, "Is radeon loaded? %s\n", (radeon_loaded ? "yes" : "no"));
+    log_msg(GPU_MANAGER_LOG_DEBUG, "Is radeon blacklisted? %s\n", (radeon_blacklisted ? "yes" : "no"));
+    log_msg(GPU_MANAGER_LOG_DEBUG, "Is amdgpu loaded? %s\n", (state.amdgpu_loaded ? "yes" : "no"));
+    log_msg(GPU_MANAGER_LOG_DEBUG, "Is amdgpu blacklisted? %s\n", (amdgpu_blacklisted ? "yes" : "no"));
+    log_msg(GPU_MANAGER_LOG_DEBUG, "Is amdgpu versioned? %s\n", (amdgpu_versioned ? "yes" : "no"));
+    log_msg(GPU_MANAGER_LOG_DEBUG, "Is amdgpu pro stack? %s\n", (state.amdgpu_is_pro ? "yes" : "no"));
+    log_msg(GPU_MANAGER_LOG_DEBUG, "Is nouveau loaded? %s\n", (state.nouveau_loaded ? "yes" : "no"));
+    log_msg(GPU_MANAGER_LOG_DEBUG, "Is nouveau blacklisted? %s\n", (nouveau_blacklisted ? "yes" : "no"));
+    log_msg(GPU_MANAGER_LOG_DEBUG, "Is nvidia kernel module available? %s\n", (state.nvidia_kmod_available ? "yes" : "no"));
+    log_msg(GPU_MANAGER_LOG_DEBUG, "Is amdgpu kernel module available? %s\n", (amdgpu_kmod_available ? "yes" : "no"));
+
+    report_prime_intel_driver();
+
+    /* See if it requires RandR offloading */
+    state.offloading = fake_lspci_file ? fake_offloading :
+                       requires_offloading(&ctx->devices, state.nvidia_unloaded);
+    log_msg(GPU_MANAGER_LOG_DEBUG, "Does it require offloading? %s\n", (state.offloading ? "yes" : "no"));
+
+    /* Read the data from last boot */
+    begin_probe("last boot");
+    status = read_data_from_file(last_boot_file, &old_devices);
+    end_probe();
+    if (!status) {
+        log_msg(GPU_MANAGER_LOG_ERR, "Can't read %s\n", last_boot_file);
+        return -EIO;
+    }
+
+    log_msg(GPU_MANAGER_LOG_DEBUG, "last cards number = %d\n", old_devices.nr_cards);
+
+    /* See if the system has changed */
+    state.has_changed = has_system_changed(&old_devices, &ctx->devices);
+    log_msg(GPU_MANAGER_LOG_DEBUG, "Has the system changed? %s\n", state.has_changed ? "Yes" : "No");
+
+    if (state.has_changed)
+        log_msg(GPU_MANAGER_LOG_INFO, "System configuration has changed\n");
+
+    log_msg(GPU_MANAGER_LOG_DEBUG, "Did the PCIe link health change? %s\n",
+            has_link_health_changed(&old_devices, &ctx->devices) ? "yes" : "no");
+    free_devices(&old_devices);
+
+    state.has_offload_layout = has_xorg_d_custom_file("11-nvidia-offload.conf");
+    /* enable_prime() creates the settings with "on" if there are none */
+    state.prime_mode = (prime_mode_override || (active_quirk && active_quirk->prime_mode >= 0) ||
+                        exists_not_empty(prime_settings)) ?
+                       get_prime_action(prime_settings) : ON;
+    state.find_disabled_cards = true;
+
+    status = decide(&ctx->devices, &state, &decision, &discrete_device) ? 0 : -ENODEV;
+    to_public_decision(&decision, public_decision);
+    return status;
+}
+
+
+/* Remove the file that tells other apps such as nvidia-prime if we need
+ * to offload rendering, and write the probed devices for the next boot.
+ */
+static bool record_devices(struct gpu_manager_context *ctx, int offloading)
+{
+    struct gpus probed = ctx->devices;
+
+    if (!offloading && !dry_run)
+        unlink(OFFLOADING_CONF);
+
+    probed.nr_cards = ctx->nr_probed;
+    if (!write_data_to_file(new_boot_file, &probed)) {
+        log_msg(GPU_MANAGER_LOG_ERR, "Error: can't write to %s\n", new_boot_file);
+        return false;
+    }
+    return true;
+}
+
+
+int gpu_manager_apply(struct gpu_manager_context *ctx,
+                      struct gpu_manager_decision *public_decision)
+{
+    struct decision decision;
+    struct device *discrete_device = NULL;
+    char bdf[32];
+
+    enter_context(ctx);
+    load_gpu_policies(policy_file);
+    from_public_decision(public_decision, &decision);
+
+    if (!record_devices(ctx, decision.offloading))
+        return -EIO;
+
+    for (int i = 0; i < ctx->devices.nr_cards; i++) {
+        get_bdf(ctx->devices.cards[i], bdf, sizeof(bdf));
+        if (strcmp(bdf, decision.discrete) == 0)
+            discrete_device = ctx->devices.cards[i];
+    }
+    if (decision.action == ACTION_PRIME && !discrete_device)
+        return -EINVAL;
+
+    apply_decision(&ctx->devices, discrete_device, &decision);
+
+    decision.timestamp = time(NULL);
+    log_msg(GPU_MANAGER_LOG_INFO, "Decision: %s\n", action_names[decision.action]);
+    if (!dry_run)
+        write_decision_to_file(last_decision_file, &decision);
+    if (metrics_textfile)
+        export_metrics(&ctx->devices, &decision);
+
+    to_public_decision(&decision, public_decision);
+    return 0;
+}
+
+
+/* What the probing child found, in memory shared with it */
+struct probing {
+    struct watchdog_probe probe;
+    /* Set by the child when it's done */
+    bool done;
+    struct gpu_manager_decision decision;
+    int inventory_status;
+    int status;
+    /* The inventory of the context, as it can't be shared */
+    struct device cards[MAX_NR_CARDS];
+    int nr_cards;
+    char passthrough[MAX_NR_CARDS][32];
+    int nr_passthrough;
+    int nr_probed;
+    bool probed;
+    struct quirk quirk;
+    bool has_quirk;
+};
+
+
+static void run_probing(struct gpu_manager_context *ctx, struct probing *probing)
+{
+    probing->inventory_status = gpu_manager_inventory(ctx, true);
+    probing->status = probing->inventory_status;
+    if (probing->status >= 0)
+        probing->status = gpu_manager_decide(ctx, &probing->decision);
+}
+
+
+/* Run in the probing child: probe, pass the results on, and exit */
+static void probe_in_child(struct gpu_manager_context *ctx, struct probing *probing,
+                           int log_fd)
+{
+    FILE *log = fdopen(log_fd, "w");
+
+    if (!log)
+        _exit(EXIT_FAILURE);
+
+    /* Our log goes to the parent, a line at a time */
+    setvbuf(log, NULL, _IOLBF, 0);
+    ctx->log = log;
+    watchdog_probe = &probing->probe;
+
+    run_probing(ctx, probing);
+
+    for (int i = 0; i < ctx->devices.nr_cards; i++)
+        probing->cards[i] = *ctx->devices.cards[i];
+    probing->nr_cards = ctx->devices.nr_cards;
+    memcpy(probing->passthrough, ctx->devices.passthrough, sizeof(probing->passthrough));
+    probing->nr_passthrough = ctx->devices.nr_passthrough;
+    probing->nr_probed = ctx->nr_probed;
+    probing->probed = ctx->probed;
+    probing->quirk = ctx->quirk;
+    probing->has_quirk = ctx->has_quirk;
+    probing->done = true;
+
+    fflush(log);
+    _exit(EXIT_SUCCESS);
+}
+
+
+/* Take the inventory of the probing child over */
+static void take_inventory(struct gpu_manager_context *ctx, const struct probing *probing)
+{
+    free_devices(&ctx->devices);
+    for (int i = 0; i < probing->nr_cards; i++) {
+        ctx->devices.cards[i] = malloc(sizeof(struct device));
+        if (!ctx->devices.cards[i])
+            break;
+        *ctx->devices.cards[i] = probing->cards[i];
+        ctx->devices.nr_cards++;
+    }
+    memcpy(ctx->devices.passthrough, probing->passthrough, sizeof(ctx->devices.passthrough));
+    ctx->devices.nr_passthrough = probing->nr_passthrough;
+    ctx->nr_probed = probing->nr_probed < ctx->devices.nr_cards ?
+                     probing->nr_probed : ctx->devices.nr_cards;
+    ctx->probed = probing->probed;
+    ctx->quirk = probing->quirk;
+    ctx->has_quirk = probing->has_quirk;
+    active_quirk = ctx->has_quirk ? &ctx->quirk : NULL;
+}
+
+
+/* Pass the log of the probing child on, a line at a time. Return false
+ * when it's closed.
+ */
+static bool relay_log(int fd, char *buffer, size_t size, size_t *len)
+{
+    char *start = buffer;
+    char *end;
+    ssize_t ret;
+
+    ret = read(fd, buffer + *len, size - *len);
+    if (ret < 0)
+        return errno == EINTR || errno == EAGAIN;
+    if (ret == 0) {
+        if (*len > 0)
+            fprintf(log_handle, "%.*s\n", (int)*len, buffer);
+        *len = 0;
+        return false;
+    }
+
+    *len += ret;
+    while ((end = memchr(start, '\n', buffer + *len - start))) {
+        fprintf(log_handle, "%.*s\n", (int)(end - start), start);
+        start = end + 1;
+    }
+    *len -= start - buffer;
+    memmove(buffer, start, *len);
+
+    /* Don't hold overlong lines back */
+    if (*len == size) {
+        fprintf(log_handle, "%.*s\n", (int)*len, buffer);
+        *len = 0;
+    }
+
+    return true;
+}
+
+
+/* Relay the log of the probing child until it's done, or until the
+ * deadlines. Return false if it stalled.
+ */
+static bool wait_for_probing(int log_fd, struct probing *probing)
+{
+    long long run_deadline = get_monotonic_ms() + deadline_ms;
+    char buffer[1024];
+    size_t len = 0;
+
+    while (true) {
+        struct pollfd pfd = { .fd = log_fd, .events = POLLIN };
+        long long probe_start = __atomic_load_n(&probing->probe.start, __ATOMIC_ACQUIRE);
+        long long deadline = run_deadline;
+        long long now = get_monotonic_ms();
+
+        if (probe_start && probe_start + probe_budget_ms < deadline)
+            deadline = probe_start + probe_budget_ms;
+
+        if (now >= deadline) {
+            if (len > 0)
+                fprintf(log_handle, "%.*s\n", (int)len, buffer);
+            if (probe_start)
+                log_msg(GPU_MANAGER_LOG_WARNING, "Watchdog: probe %s stalled for %lld ms\n",
+                        probing->probe.name, now - probe_start);
+            else
+                log_msg(GPU_MANAGER_LOG_WARNING, "Watchdog: probing took more than %d ms\n", deadline_ms);
+            return false;
+        }
+
+        /* Look again soon, as a probe may begin in the meantime */
+        if (poll(&pfd, 1, deadline - now < 50 ? (int)(deadline - now) : 50) > 0 &&
+            !relay_log(log_fd, buffer, sizeof(buffer), &len))
+            return true;
+    }
+}
+
+
+/* Probe the system and decide, within the deadlines of the watchdog.
+ * Return -ETIMEDOUT if probing stalled, or if the child died.
+ */
+static int probe_with_watchdog(struct gpu_manager_context *ctx, struct probing *probing)
+{
+    int log_fds[2];
+    pid_t pid;
+
+    if (deadline_ms <= 0) {
+        run_probing(ctx, probing);
+        return 0;
+    }
+
+    if (pipe2(log_fds, O_CLOEXEC) != 0) {
+        log_msg(GPU_MANAGER_LOG_WARNING, "Warning: can't start the watchdog: %s\n", strerror(errno));
+        run_probing(ctx, probing);
+        return 0;
+    }
+
+    fflush(log_handle);
+    pid = fork();
+    if (pid < 0) {
+        log_msg(GPU_MANAGER_LOG_WARNING, "Warning: can't start the watchdog: %s\n", strerror(errno));
+        close(log_fds[0]);
+        close(log_fds[1]);
+        run_probing(ctx, probing);
+        return 0;
+    }
+    if (pid == 0) {
+        close(log_fds[0]);
+        probe_in_child(ctx, probing, log_fds[1]);
+    }
+
+    close(log_fds[1]);
+    if (!wait_for_probing(log_fds[0], probing)) {
+        close(log_fds[0]);
+        /* It may be stuck in the kernel, don't wait for it */
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, WNOHANG);
+        return -ETIMEDOUT;
+    }
+    close(log_fds[0]);
+
+    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+        ;
+    if (!probing->done) {
+        log_msg(GPU_MANAGER_LOG_WARNING, "Watchdog: probing died\n");
+        return -ETIMEDOUT;
+    }
+
+    take_inventory(ctx, probing);
+    return 0;
+}
+
+
+int gpu_manager_run(struct gpu_manager_context *ctx)
+{
+    struct gpu_manager_decision decision = {0};
+    struct decision journal_decision;
+    struct timespec start_time, end_time;
+    struct probing *probing;
+    int inventory_status;
+    int status;
+
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    enter_context(ctx);
+
+    if (is_disabled_in_cmdline()) {
+        log_msg(GPU_MANAGER_LOG_INFO, "Disabled by kernel parameter \"%s\"\n", KERN_PARAM);
+        return -EPERM;
+    }
+    if (apply_cmdline_overrides(ctx) > 0)
+        enter_context(ctx);
+
+    log_settings();
+    start_speculative_load();
+
+    /* Shared with the probing child */
+    probing = mmap(NULL, sizeof(*probing), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (probing == MAP_FAILED) {
+        finish_speculative_load(&decision, false);
+        return -ENOMEM;
+    }
+
+    if (probe_with_watchdog(ctx, probing) < 0) {
+        munmap(probing, sizeof(*probing));
+        /* The speculative load followed the last decision */
+        if (read_decision_from_file(last_decision_file, &journal_decision))
+            to_public_decision(&journal_decision, &decision);
+        finish_speculative_load(&decision, true);
+        apply_last_decision();
+        log_msg(GPU_MANAGER_LOG_WARNING, "Watchdog: giving up on probing\n");
+        return -ETIMEDOUT;
+    }
+
+    status = probing->status;
+    decision = probing->decision;
+    inventory_status = probing->inventory_status;
+    munmap(probing, sizeof(*probing));
+    if (inventory_status < 0) {
+        finish_speculative_load(&decision, false);
+        return status;
+    }
+
+    finish_speculative_load(&decision, status == 0);
+    if (status == 0)
+        status = gpu_manager_apply(ctx, &decision);
+    else if (status == -ENODEV)
+        record_devices(ctx, decision.offloading);
+
+    /* Keep a record of every run which got to probe the hardware */
+    if (!dry_run && ctx->devices.nr_cards > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+        from_public_decision(&decision, &journal_decision);
+        append_to_journal(journal_file, &ctx->devices, &journal_decision,
+                          (end_time.tv_sec - start_time.tv_sec) * 1000 +
+                          (end_time.tv_nsec - start_time.tv_nsec) / 1000000);
+    }
+
+    return status;
+}
+
+
+int gpu_manager_watch(struct gpu_manager_context *ctx)
+{
+    struct decision decision;
+    struct device discrete = {0};
+
+    enter_context(ctx);
+
+    if (!read_decision_from_file(last_decision_file, &decision) ||
+        decision.action != ACTION_PRIME) {
+        log_msg(GPU_MANAGER_LOG_INFO, "Nothing to watch: the last decision wasn't PRIME\n");
+        return 0;
+    }
+    if (!get_device_from_bdf(decision.discrete, &discrete)) {
+        log_msg(GPU_MANAGER_LOG_ERR, "Error: invalid discrete GPU %s\n", decision.discrete);
+        return -EINVAL;
+    }
+    /* PRIME is only for NVIDIA GPUs */
+    discrete.vendor_id = NVIDIA;
+    load_gpu_policies(policy_file);
+
+    return watch_prime_settings(&discrete, &decision);
+}
+
+
+int gpu_manager_export_metrics(struct gpu_manager_context *ctx)
+{
+    struct gpus gpus = {0};
+    struct decision decision;
+    bool status;
+
+    enter_context(ctx);
+
+    /* Don't create the file if it's not there */
+    if (access(last_boot_file, R_OK) == 0)
+        read_data_from_file(last_boot_file, &gpus);
+    read_decision_from_file(last_decision_file, &decision);
+    status = export_metrics(&gpus, &decision);
+    free_devices(&gpus);
+
+    return status ? 0 : -EIO;
+}
+
+
+int gpu_manager_print_inventory(struct gpu_manager_context *ctx, FILE *file)
+{
+    struct gpus gpus = {0};
+
+    enter_context(ctx);
+
+    if (access(last_boot_file, R_OK) == 0)
+        read_data_from_file(last_boot_file, &gpus);
+    print_inventory(file, &gpus);
+    free_devices(&gpus);
+
+    return 0;
+}
+
+
+int gpu_manager_print_status(struct gpu_manager_context *ctx, FILE *file,
+                             bool json, bool refresh_devices)
+{
+    struct gpus cached = {0};
+    struct gpus *gpus = &cached;
+    struct decision decision;
+    bool has_decision;
+
+    enter_context(ctx);
+
+    /* Only probe the hardware if asked to */
+    if (refresh_devices) {
+        if (gpu_manager_inventory(ctx, true) < 0)
+            fprintf(stderr, "Error: can't probe the current devices\n");
+        gpus = &ctx->devices;
+    }
+    else if (access(last_boot_file, R_OK) == 0) {
+        read_data_from_file(last_boot_file, &cached);
+    }
+    has_decision = read_decision_from_file(last_decision_file, &decision);
+    print_status(file, gpus, &decision, has_decision, json, refresh_devices);
+    free_devices(&cached);
+
+    return 0;
+}
+
+
+int gpu_manager_print_journal(struct gpu_manager_context *ctx, FILE *file,
+                              long long since, long long until)
+{
+    enter_context(ctx);
+    return print_journal(file, journal_file, since, until) ? 0 : -EIO;
+}
+
+
+int gpu_manager_simulate(struct gpu_manager_context *ctx, FILE *input, FILE *output)
+{
+    enter_context(ctx);
+    simulate(input, output);
+    return 0;
+}
@@ -15,6 +15,7 @@ import shutil
 import re
 import argparse
 import copy
+import subprocess
 
 # Global path to save logs
 tests_path = None
@@ -23,6 +24,11 @@ with_valgrind = False
 # Global path to use gdb
 with_gdb = False
 
+# gpu-manager is linked with the libgpumanager.so.1 built next to it
+os.environ['LD_LIBRARY_PATH'] = ':'.join(
+    [os.path.abspath('share/hybrid')] +
+    [p for p in os.environ.get('LD_LIBRARY_PATH', '').split(':') if p])
+
 
 class GpuTest(object):
 
@@ -126,6 +132,12 @@ class GpuManagerTest(unittest.TestCase):
         klass.dmi_product_name_path = tempfile.NamedTemporaryFile(
             mode='w', prefix='dmi_product_name_path_', dir=tests_path, delete=False)
         klass.dmi_product_name_path.close()
+        klass.quirks_file = tempfile.NamedTemporaryFile(
+            mode='w', prefix='quirks_file_', dir=tests_path, delete=False)
+        klass.quirks_file.close()
+        klass.policy_file = tempfile.NamedTemporaryFile(
+            mode='w', prefix='policy_file_', dir=tests_path, delete=False)
+        klass.policy_file.close()
         klass.nvidia_driver_version_path = tempfile.NamedTemporaryFile(
             mode='w', prefix='nvidia_driver_version_path_', dir=tests_path, delete=False)
         klass.nvidia_driver_version_path.close()
@@ -208,6 +220,8 @@ class GpuManagerTest(unittest.TestCase):
         for elem in (self.prime_settings,
                      self.dmi_product_version_path,
                      self.dmi_product_name_path,
+                     self.quirks_file,
+                     self.policy_file,
                      self.nvidia_driver_version_path):
             try:
                 os.unlink(elem.name)
@@ -244,6 +258,8 @@ class GpuManagerTest(unittest.TestCase):
                      self.prime_settings,
                      self.dmi_product_version_path,
                      self.dmi_product_name_path,
+                     self.quirks_file,
+                     self.policy_file,
                      self.nvidia_driver_version_path,
                      self.modprobe_d_path,
                      self.log,
@@ -305,6 +321,10 @@ class GpuManagerTest(unittest.TestCase):
                    self.dmi_product_version_path.name,
                    '--dmi-product-name-path',
                    self.dmi_product_name_path.name,
+                   '--quirks-file',
+                   self.quirks_file.name,
+                   '--policy-file',
+                   self.policy_file.name,
                    '--nvidia-driver-version-path',
                    self.nvidia_driver_version_path.name,
                    '--modprobe-d-path',
@@ -316,7 +336,10 @@ class GpuManagerTest(unittest.TestCase):
                    fake_requires_offloading,
                    fake_module_available,
                    '--log',
-                   self.log.name]
+                   self.log.name,
+                   # The checks read the details of the probing
+                   '--log-level',
+                   'debug']
 
         if module_is_versioned:
             command.append('--fake-module-is-versioned')
@@ -582,6 +605,20 @@ class GpuManagerTest(unittest.TestCase):
         self.dmi_product_name_path.write('%s\n' % label)
         self.dmi_product_name_path.close()
 
+    def set_quirks(self, lines):
+        '''Set the quirks of the models'''
+        self.quirks_file = open(self.quirks_file.name, 'w')
+        for line in lines:
+            self.quirks_file.write('%s\n' % line)
+        self.quirks_file.close()
+
+    def set_gpu_policies(self, lines):
+        '''Set the GPU policies'''
+        self.policy_file = open(self.policy_file.name, 'w')
+        for line in lines:
+            self.policy_file.write('%s\n' % line)
+        self.policy_file.close()
+
     def set_bbswitch_quirks(self):
         '''Set bbswitch quirks'''
         self.bbswitch_quirks_path = open(self.bbswitch_quirks_path.name, 'w')
@@ -3586,6 +3623,68 @@ class GpuManagerTest(unittest.TestCase):
         # No further action is required
         self.assertTrue(gpu_test.has_not_acted)
 
+    def test_laptop_one_amd_one_nvidia_binary(self):
+        '''laptop: amd (APU) + nvidia'''
+        self.this_function_name = sys._getframe().f_code.co_name
+
+        # Request PRIME on
+        self.request_prime_discrete_on(True)
+
+        gpu_test = self.run_manager_and_get_data(['amd'],
+                                                 ['amd', 'nvidia'],
+                                                 ['amdgpu', 'nvidia'],
+                                                 ['mesa', 'nvidia'],
+                                                 requires_offloading=True)
+
+        # Check the variables
+
+        # Check if laptop
+        self.assertTrue(gpu_test.requires_offloading)
+
+        self.assertFalse(gpu_test.has_single_card)
+
+        # AMD
+        self.assertFalse(gpu_test.radeon_loaded)
+        self.assertTrue(gpu_test.amdgpu_loaded)
+        # NVIDIA
+        self.assertFalse(gpu_test.nouveau_loaded)
+        self.assertTrue(gpu_test.nvidia_loaded)
+        # Has changed
+        self.assertTrue(gpu_test.has_changed)
+
+        self.assertFalse(gpu_test.has_selected_driver)
+
+        # Check that the xorg.conf.d file was created
+        self.assertTrue(gpu_test.has_created_xorg_conf_d)
+
+        # Case 2: the nvidia module is not loaded, but it is available
+        self.request_prime_discrete_on(True)
+
+        gpu_test = self.run_manager_and_get_data(['amd', 'nvidia'],
+                                                 ['amd', 'nvidia'],
+                                                 ['amdgpu'],
+                                                 ['mesa', 'nvidia'],
+                                                 requires_offloading=True,
+                                                 module_is_available=True)
+
+        self.assertTrue(gpu_test.requires_offloading)
+        self.assertTrue(gpu_test.amdgpu_loaded)
+        self.assertFalse(gpu_test.nvidia_loaded)
+        self.assertFalse(gpu_test.has_changed)
+        self.assertTrue(gpu_test.has_created_xorg_conf_d)
+
+        # Case 3: desktop with open drivers only
+        gpu_test = self.run_manager_and_get_data(['amd', 'nvidia'],
+                                                 ['amd', 'nvidia'],
+                                                 ['amdgpu', 'nouveau'],
+                                                 ['mesa'],
+                                                 requires_offloading=False)
+
+        self.assertFalse(gpu_test.requires_offloading)
+        self.assertTrue(gpu_test.nouveau_loaded)
+        self.assertFalse(gpu_test.has_created_xorg_conf_d)
+        self.assertTrue(gpu_test.has_not_acted)
+
     def test_desktop_one_intel_one_nvidia_binary(self):
         '''desktop: intel + nvidia'''
         self.this_function_name = sys._getframe().f_code.co_name
@@ -4575,6 +4674,196 @@ class GpuManagerTest(unittest.TestCase):
         # No further action is required
         self.assertFalse(gpu_test.has_not_acted)
 
+    def test_simulate(self):
+        self.this_function_name = sys._getframe().f_code.co_name
+
+        scenarios = ('# comment\n'
+                     'id=optimus gpu=8086:68d8;0000:00:02:0;1 gpu=10de:28e8;0000:01:00:0;0 '
+                     'loaded=i915 available=nvidia offloading=1 prime=on-demand\n'
+                     'id=desktop gpu=8086:68d8;0000:00:02:0;1 gpu=10de:28e8;0000:01:00:0;0 '
+                     'loaded=i915,nvidia offloading=0\n'
+                     '\n'
+                     'id=nvidia gpu=10de:28e8;0000:01:00:0;1 offload_layout=1\n'
+                     'id=invalid gpu=foo\n')
+
+        output = subprocess.run(['share/hybrid/gpu-manager', 'simulate'], input=scenarios,
+                                stdout=subprocess.PIPE, universal_newlines=True,
+                                check=True).stdout
+
+        self.assertEqual(output.splitlines(), [
+            'optimus action=prime prime_mode=on-demand offloading=1 discrete=0000:01:00.0',
+            'desktop action=none prime_mode=off offloading=0 discrete=none',
+            'nvidia action=remove-offload prime_mode=off offloading=0 discrete=none',
+            'invalid error=line 6',
+        ])
+
+    def test_disabled_in_cmdline(self):
+        self.this_function_name = sys._getframe().f_code.co_name
+
+        with tempfile.TemporaryDirectory() as tmp:
+            cmdline = os.path.join(tmp, 'cmdline')
+            log = os.path.join(tmp, 'log')
+            with open(cmdline, 'w') as f:
+                f.write('BOOT_IMAGE=/vmlinuz "acpi_osi=Windows 2015" nogpumanager quiet\n')
+
+            subprocess.run(['share/hybrid/gpu-manager', '--fake-cmdline', cmdline,
+                            '--last-boot-file', self.last_boot_file.name,
+                            '--log', log], check=False)
+            with open(log) as f:
+                self.assertIn('Disabled by kernel parameter "nogpumanager"', f.read())
+
+    def test_laptop_one_intel_one_nvidia_dmi_quirk(self):
+        '''laptop: intel + nvidia, with a quirk for the model'''
+        self.this_function_name = sys._getframe().f_code.co_name
+
+        quirks = ['# A comment',
+                  'product_version=Other Laptop; mode=on',
+                  'product_name=Fake Laptop 15; gpu=nvidia; mode=on-demand; pm=on',
+                  'product_name=Fake Laptop 15; gpu=amd; mode=off']
+
+        # Case 1: no PRIME settings, the quirk is the default
+        self.set_quirks(quirks)
+        # DMI strings are often padded with spaces
+        self.set_dmi_product_name('Fake Laptop 15   ')
+
+        gpu_test = self.run_manager_and_get_data(['intel', 'nvidia'],
+                                                 ['intel', 'nvidia'],
+                                                 ['i915', 'nvidia'],
+                                                 ['mesa', 'nvidia'],
+                                                 requires_offloading=True)
+
+        self.assertTrue(gpu_test.matched_quirk)
+        with open(self.log.name) as f:
+            output = f.read()
+        self.assertIn('Plan for PRIME mode on-demand:', output)
+        self.assertIn('Runtime power management disabled by quirk', output)
+
+        # Case 2: the settings of the user win over the quirk
+        self.set_quirks(quirks)
+        self.set_dmi_product_name('Fake Laptop 15')
+        self.request_prime_discrete_on(False)
+
+        gpu_test = self.run_manager_and_get_data(['intel', 'nvidia'],
+                                                 ['intel', 'nvidia'],
+                                                 ['i915', 'nvidia'],
+                                                 ['mesa', 'nvidia'],
+                                                 requires_offloading=True)
+
+        self.assertTrue(gpu_test.matched_quirk)
+        with open(self.log.name) as f:
+            output = f.read()
+        self.assertIn('Plan for PRIME mode off:', output)
+
+        # Case 3: only the entry of the GPU which is there matches
+        self.set_quirks(quirks)
+        self.set_dmi_product_name('Fake Laptop 15')
+
+        gpu_test = self.run_manager_and_get_data(['intel', 'amd'],
+                                                 ['intel', 'amd'],
+                                                 ['i915', 'amdgpu'],
+                                                 ['mesa'],
+                                                 requires_offloading=True)
+
+        self.assertTrue(gpu_test.matched_quirk)
+
+        # Case 4: no quirk for the model
+        self.set_quirks(quirks)
+        self.set_dmi_product_name('Fake Laptop 17')
+
+        gpu_test = self.run_manager_and_get_data(['intel', 'nvidia'],
+                                                 ['intel', 'nvidia'],
+                                                 ['i915', 'nvidia'],
+                                                 ['mesa', 'nvidia'],
+                                                 requires_offloading=True)
+
+        self.assertFalse(gpu_test.matched_quirk)
+
+        # Case 5: a built-in quirk
+        self.set_quirks(quirks)
+        self.set_dmi_product_name('Latitude E6530')
+
+        gpu_test = self.run_manager_and_get_data(['intel', 'nvidia'],
+                                                 ['intel', 'nvidia'],
+                                                 ['i915', 'nvidia'],
+                                                 ['mesa', 'nvidia'],
+                                                 requires_offloading=True)
+
+        self.assertTrue(gpu_test.matched_quirk)
+        with open(self.log.name) as f:
+            output = f.read()
+        self.assertIn('Found matching quirk: Latitude E6530 (built-in)', output)
+        self.assertIn('Plan for PRIME mode on:', output)
+
+        # Case 6: the quirks file comes before the built-in quirks
+        self.set_quirks(quirks + ['product_name=Latitude E6530; gpu=nvidia; mode=on-demand'])
+        self.set_dmi_product_name('Latitude E6530')
+
+        gpu_test = self.run_manager_and_get_data(['intel', 'nvidia'],
+                                                 ['intel', 'nvidia'],
+                                                 ['i915', 'nvidia'],
+                                                 ['mesa', 'nvidia'],
+                                                 requires_offloading=True)
+
+        self.assertTrue(gpu_test.matched_quirk)
+        with open(self.log.name) as f:
+            output = f.read()
+        self.assertIn('Found matching quirk: Latitude E6530\n', output)
+        self.assertIn('Plan for PRIME mode on-demand:', output)
+
+    def test_laptop_one_intel_one_nvidia_off_by_policy(self):
+        '''laptop: intel + nvidia, with the nvidia GPU off by policy'''
+        self.this_function_name = sys._getframe().f_code.co_name
+
+        self.set_gpu_policies(['nvidia mode=off'])
+
+        gpu_test = self.run_manager_and_get_data(['intel', 'nvidia'],
+                                                 ['intel', 'nvidia'],
+                                                 ['i915', 'nvidia'],
+                                                 ['mesa', 'nvidia'],
+                                                 requires_offloading=True)
+
+        # Turned off through PRIME, even though nothing else is selected
+        with open(self.log.name) as f:
+            output = f.read()
+        self.assertIn('is off by policy', output)
+        self.assertIn('Plan for PRIME mode off:', output)
+        self.assertIn('  - nvidia\n', output)
+        self.assertIn('  ~ power/control: auto\n', output)
+
+        # The module stays with keep-module
+        self.set_gpu_policies(['nvidia mode=off keep-module=yes'])
+
+        gpu_test = self.run_manager_and_get_data(['intel', 'nvidia'],
+                                                 ['intel', 'nvidia'],
+                                                 ['i915', 'nvidia'],
+                                                 ['mesa', 'nvidia'],
+                                                 requires_offloading=True)
+
+        with open(self.log.name) as f:
+            output = f.read()
+        self.assertIn('Plan for PRIME mode off:', output)
+        self.assertNotIn('  - nvidia\n', output)
+
+    def test_cmdline_overrides(self):
+        self.this_function_name = sys._getframe().f_code.co_name
+
+        with tempfile.TemporaryDirectory() as tmp:
+            cmdline = os.path.join(tmp, 'cmdline')
+            log = os.path.join(tmp, 'log')
+            with open(cmdline, 'w') as f:
+                f.write('quiet gpumanager.nowake=0 gpumanager.fake_lspci=/tmp/lspci '
+                        'gpumanager.last-boot-file=/tmp/last\n')
+
+            subprocess.run(['share/hybrid/gpu-manager', '--dry-run', '--fake-cmdline', cmdline,
+                            '--last-boot-file', self.last_boot_file.name,
+                            '--fake-lspci', self.fake_lspci.name,
+                            '--log', log], check=False)
+            with open(log) as f:
+                output = f.read()
+            self.assertIn('Boot parameter overrides no-wake: 0', output)
+            self.assertIn('Ignoring invalid boot parameter "gpumanager.fake_lspci=/tmp/lspci"', output)
+            self.assertIn('Ignoring invalid boot parameter "gpumanager.last-boot-file=/tmp/last"', output)
+
 
 if __name__ == '__main__':
     if '86' not in os.uname()[4]:
@@ -164,6 +164,23 @@ class DetectTest(unittest.TestCase):
             modalias_nv]))
         self.assertTrue(res['pci:vDEADBEEFd00'].endswith('/sys/devices/grey'))
 
+    @unittest.skipUnless(UbuntuDrivers.detect._modaliases, 'native modalias helper not built')
+    @unittest.skipUnless(os.path.isdir('/sys/devices'), 'no /sys dir on this system')
+    def test_system_modaliases_native(self):
+        '''native system_modaliases() finds the same devices as walking /sys/devices'''
+
+        del self.umockdev
+        native = UbuntuDrivers.detect._modaliases
+        UbuntuDrivers.detect._modaliases = None
+        try:
+            walked = UbuntuDrivers.detect.system_modaliases()
+        finally:
+            UbuntuDrivers.detect._modaliases = native
+        res = native.system_modaliases('/sys')
+        self.assertEqual(set(res), set(walked))
+        for path in res.values():
+            self.assertTrue(path.startswith('/sys/devices/'))
+
     def test_system_driver_packages_performance(self):
         '''system_driver_packages() performance for a lot of modaliases'''
 